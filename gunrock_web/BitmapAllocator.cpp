@@ -0,0 +1,282 @@
+#include <cstring>
+#include <set>
+
+#include "BitmapAllocator.h"
+#include "ufs.h"
+
+using namespace std;
+
+// The words are filled straight from the bitmap blocks, so on a little
+// endian machine bit i of the bitmap, i.e. bit i % 8 of byte i / 8, is
+// bit i % 64 of word i / 64.
+#define BITS_PER_WORD (64)
+#define BITS_PER_BLOCK (UFS_BLOCK_SIZE * 8)
+#define WORDS_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(uint64_t))
+
+BitmapAllocator::BitmapAllocator(BufferCache *cache, int bitmapAddr, int bitmapLen, int numBits) {
+  this->bitmapAddr = bitmapAddr;
+  this->bitmapLen = bitmapLen;
+  this->numBits = numBits;
+  this->hint = 0;
+  this->numReserved = 0;
+  pthread_mutex_init(&this->lock, NULL);
+
+  words.resize(bitmapLen * WORDS_PER_BLOCK);
+  for (int i = 0; i < bitmapLen; i++) {
+    cache->readBlock(bitmapAddr + i, &words[i * WORDS_PER_BLOCK]);
+  }
+  committed = words;
+  countFree();
+}
+
+BitmapAllocator::~BitmapAllocator() {
+  pthread_mutex_destroy(&lock);
+}
+
+// bits past numBits in the last word are padding and never handed out
+static inline uint64_t paddingMask(int word, int numBits) {
+  int numWords = (numBits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  if (word != numWords - 1 || numBits % BITS_PER_WORD == 0) {
+    return 0;
+  }
+  return ~((1ULL << (numBits % BITS_PER_WORD)) - 1);
+}
+
+void BitmapAllocator::countFree() {
+  int numWords = (numBits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  int used = 0;
+  for (int w = 0; w < numWords; w++) {
+    used += __builtin_popcountll(words[w] & ~paddingMask(w, numBits));
+  }
+  numFree = numBits - used;
+}
+
+int BitmapAllocator::nextFree(int bit) {
+  pthread_mutex_lock(&lock);
+  int next = findFree(bit);
+  pthread_mutex_unlock(&lock);
+  return next;
+}
+
+int BitmapAllocator::nextAllocated(int bit) {
+  pthread_mutex_lock(&lock);
+  int next = findAllocated(bit);
+  pthread_mutex_unlock(&lock);
+  return next;
+}
+
+int BitmapAllocator::numberOfFree() {
+  pthread_mutex_lock(&lock);
+  int available = numFree - numReserved;
+  pthread_mutex_unlock(&lock);
+  return available;
+}
+
+int BitmapAllocator::findFree(int bit) {
+  int numWords = (numBits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  for (int w = bit / BITS_PER_WORD; bit < numBits && w < numWords; w++) {
+    uint64_t used = words[w] | paddingMask(w, numBits);
+    if (w == bit / BITS_PER_WORD) {
+      // ignore the bits before the starting bit
+      used |= (1ULL << (bit % BITS_PER_WORD)) - 1;
+    }
+    if (used != ~0ULL) {
+      return w * BITS_PER_WORD + __builtin_ctzll(~used);
+    }
+  }
+  return numBits;
+}
+
+int BitmapAllocator::findAllocated(int bit) {
+  int numWords = (numBits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  for (int w = bit / BITS_PER_WORD; bit < numBits && w < numWords; w++) {
+    uint64_t used = words[w] | paddingMask(w, numBits);
+    if (w == bit / BITS_PER_WORD) {
+      used &= ~((1ULL << (bit % BITS_PER_WORD)) - 1);
+    }
+    if (used != 0) {
+      int next = w * BITS_PER_WORD + __builtin_ctzll(used);
+      return next < numBits ? next : numBits;
+    }
+  }
+  return numBits;
+}
+
+bool BitmapAllocator::reserve(BitmapChanges *changes, int count) {
+  pthread_mutex_lock(&lock);
+  bool reserved = count <= numFree - numReserved;
+  if (reserved) {
+    numReserved += count;
+    changes->reserved += count;
+  }
+  pthread_mutex_unlock(&lock);
+  return reserved;
+}
+
+void BitmapAllocator::unreserve(BitmapChanges *changes, int count) {
+  pthread_mutex_lock(&lock);
+  count = count < changes->reserved ? count : changes->reserved;
+  numReserved -= count;
+  changes->reserved -= count;
+  pthread_mutex_unlock(&lock);
+}
+
+// free bits that no other transaction has reserved. The caller's own
+// reservation is left in, since claim() draws it down first.
+int BitmapAllocator::available(BitmapChanges *changes) {
+  return numFree - numReserved + changes->reserved;
+}
+
+int BitmapAllocator::allocate(BitmapChanges *changes, int goal) {
+  pthread_mutex_lock(&lock);
+  if (available(changes) <= 0) {
+    pthread_mutex_unlock(&lock);
+    return -1;
+  }
+
+  // search from the goal to the end, then wrap around to the start
+  int start = goal >= 0 && goal < numBits ? goal : hint;
+  int bit = findFree(start);
+  if (bit == numBits) {
+    bit = findFree(0);
+  }
+  claim(changes, bit);
+  hint = (bit + 1) % numBits;
+  pthread_mutex_unlock(&lock);
+  return bit;
+}
+
+int BitmapAllocator::allocateRun(BitmapChanges *changes, int count, int goal) {
+  pthread_mutex_lock(&lock);
+  if (count <= 0 || available(changes) < count) {
+    pthread_mutex_unlock(&lock);
+    return -1;
+  }
+
+  // first fit from the goal, then from the start of the bitmap
+  int start = goal >= 0 && goal < numBits ? goal : hint;
+  int from[] = {start, 0};
+  for (int pass = 0; pass < 2; pass++) {
+    int bit = findFree(from[pass]);
+    while (bit < numBits) {
+      int end = findAllocated(bit);
+      if (end - bit >= count) {
+        for (int i = 0; i < count; i++) {
+          claim(changes, bit + i);
+        }
+        hint = (bit + count) % numBits;
+        pthread_mutex_unlock(&lock);
+        return bit;
+      }
+      bit = findFree(end);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return -1;
+}
+
+bool BitmapAllocator::allocateRange(BitmapChanges *changes, int start, int count) {
+  pthread_mutex_lock(&lock);
+  bool isFree = start >= 0 && count > 0 && start + count <= numBits && available(changes) >= count &&
+                findAllocated(start) >= start + count;
+  for (int i = 0; isFree && i < count; i++) {
+    claim(changes, start + i);
+  }
+  pthread_mutex_unlock(&lock);
+  return isFree;
+}
+
+// allocations use up the transaction's reservation first
+void BitmapAllocator::claim(BitmapChanges *changes, int bit) {
+  words[bit / BITS_PER_WORD] |= 1ULL << (bit % BITS_PER_WORD);
+  numFree--;
+  if (changes->reserved > 0) {
+    changes->reserved--;
+    numReserved--;
+  }
+  changes->allocated.push_back(bit);
+}
+
+void BitmapAllocator::release(BitmapChanges *changes, int bit) {
+  if (isAllocated(bit)) {
+    changes->released.push_back(bit);
+  }
+}
+
+bool BitmapAllocator::isAllocated(int bit) {
+  if (bit < 0 || bit >= numBits) {
+    return false;
+  }
+  pthread_mutex_lock(&lock);
+  bool allocated = (words[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+  pthread_mutex_unlock(&lock);
+  return allocated;
+}
+
+bool BitmapAllocator::isCommitted(int bit) {
+  if (bit < 0 || bit >= numBits) {
+    return false;
+  }
+  pthread_mutex_lock(&lock);
+  bool allocated = (committed[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+  pthread_mutex_unlock(&lock);
+  return allocated;
+}
+
+void BitmapAllocator::read(unsigned char *bitmap) {
+  pthread_mutex_lock(&lock);
+  memcpy(bitmap, committed.data(), bitmapLen * UFS_BLOCK_SIZE);
+  pthread_mutex_unlock(&lock);
+}
+
+void BitmapAllocator::commit(BitmapChanges *changes, map<unsigned int, unsigned char *> *blocks) {
+  set<int> changedBlocks;
+  pthread_mutex_lock(&lock);
+  for (size_t i = 0; i < changes->allocated.size(); i++) {
+    int bit = changes->allocated[i];
+    committed[bit / BITS_PER_WORD] |= 1ULL << (bit % BITS_PER_WORD);
+    changedBlocks.insert(bit / BITS_PER_BLOCK);
+  }
+  // released bits stay allocated in words until free() is called
+  for (size_t i = 0; i < changes->released.size(); i++) {
+    int bit = changes->released[i];
+    committed[bit / BITS_PER_WORD] &= ~(1ULL << (bit % BITS_PER_WORD));
+    changedBlocks.insert(bit / BITS_PER_BLOCK);
+  }
+  numReserved -= changes->reserved;
+
+  for (set<int>::iterator it = changedBlocks.begin(); it != changedBlocks.end(); it++) {
+    unsigned char *data = new unsigned char[UFS_BLOCK_SIZE];
+    memcpy(data, &committed[*it * WORDS_PER_BLOCK], UFS_BLOCK_SIZE);
+    (*blocks)[bitmapAddr + *it] = data;
+  }
+  pthread_mutex_unlock(&lock);
+  *changes = BitmapChanges();
+}
+
+// a bit can be released twice, or after being allocated by the same
+// transaction, so only count the ones that were still set
+void BitmapAllocator::free(const vector<int> &released) {
+  pthread_mutex_lock(&lock);
+  for (size_t i = 0; i < released.size(); i++) {
+    int bit = released[i];
+    uint64_t mask = 1ULL << (bit % BITS_PER_WORD);
+    if (words[bit / BITS_PER_WORD] & mask) {
+      words[bit / BITS_PER_WORD] &= ~mask;
+      numFree++;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void BitmapAllocator::rollback(BitmapChanges *changes) {
+  pthread_mutex_lock(&lock);
+  for (size_t i = 0; i < changes->allocated.size(); i++) {
+    int bit = changes->allocated[i];
+    words[bit / BITS_PER_WORD] &= ~(1ULL << (bit % BITS_PER_WORD));
+    numFree++;
+  }
+  numReserved -= changes->reserved;
+  pthread_mutex_unlock(&lock);
+  *changes = BitmapChanges();
+}
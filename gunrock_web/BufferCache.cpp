@@ -0,0 +1,195 @@
+#include <iostream>
+#include <cstring>
+
+#include "BufferCache.h"
+#include "ufs.h"
+
+using namespace std;
+
+BufferCache::BufferCache(Disk *disk, int numFrames) {
+  this->disk = disk;
+  this->numFrames = numFrames < 0 ? 0 : numFrames;
+  pthread_mutex_init(&this->lock, NULL);
+  this->numHits = 0;
+  this->numMisses = 0;
+  this->lruHead = NULL;
+  this->lruTail = NULL;
+}
+
+BufferCache::~BufferCache() {
+  invalidate();
+  for (size_t idx = 0; idx < freeFrames.size(); idx++) {
+    delete [] freeFrames[idx]->data;
+    delete freeFrames[idx];
+  }
+  pthread_mutex_destroy(&lock);
+}
+
+void BufferCache::unlinkFrame(Frame *frame) {
+  if (frame->prev != NULL) {
+    frame->prev->next = frame->next;
+  } else {
+    lruHead = frame->next;
+  }
+  if (frame->next != NULL) {
+    frame->next->prev = frame->prev;
+  } else {
+    lruTail = frame->prev;
+  }
+  frame->prev = frame->next = NULL;
+}
+
+void BufferCache::pushFrame(Frame *frame) {
+  frame->prev = NULL;
+  frame->next = lruHead;
+  if (lruHead != NULL) {
+    lruHead->prev = frame;
+  }
+  lruHead = frame;
+  if (lruTail == NULL) {
+    lruTail = frame;
+  }
+}
+
+BufferCache::Frame *BufferCache::findFrame(int blockNumber) {
+  map<int, Frame *>::iterator found = frames.find(blockNumber);
+  if (found == frames.end()) {
+    return NULL;
+  }
+
+  // move it to the front of the LRU list
+  Frame *frame = found->second;
+  if (frame != lruHead) {
+    unlinkFrame(frame);
+    pushFrame(frame);
+  }
+  return frame;
+}
+
+BufferCache::Frame *BufferCache::allocateFrame(int blockNumber) {
+  Frame *frame;
+  if (!freeFrames.empty()) {
+    frame = freeFrames.back();
+    freeFrames.pop_back();
+  } else if ((int) frames.size() < numFrames) {
+    frame = new Frame;
+    frame->data = new unsigned char[UFS_BLOCK_SIZE];
+  } else {
+    // evict the least recently used frame, it is never newer than the disk
+    frame = lruTail;
+    unlinkFrame(frame);
+    frames.erase(frame->blockNumber);
+  }
+
+  frame->blockNumber = blockNumber;
+  pushFrame(frame);
+  frames[blockNumber] = frame;
+  return frame;
+}
+
+// Caches data for blockNumber unless the block has been cached since
+// the caller read it, which makes the cached copy the newer one
+void BufferCache::fillFrame(int blockNumber, const void *data) {
+  if (numFrames > 0 && findFrame(blockNumber) == NULL) {
+    memcpy(allocateFrame(blockNumber)->data, data, UFS_BLOCK_SIZE);
+  }
+}
+
+void BufferCache::dropFrame(int blockNumber) {
+  map<int, Frame *>::iterator found = frames.find(blockNumber);
+  if (found != frames.end()) {
+    unlinkFrame(found->second);
+    freeFrames.push_back(found->second);
+    frames.erase(found);
+  }
+}
+
+void BufferCache::readBlock(int blockNumber, void *buffer) {
+  pthread_mutex_lock(&lock);
+  Frame *frame = findFrame(blockNumber);
+  if (frame != NULL) {
+    numHits++;
+    memcpy(buffer, frame->data, UFS_BLOCK_SIZE);
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  numMisses++;
+  pthread_mutex_unlock(&lock);
+
+  disk->readBlock(blockNumber, buffer);
+
+  pthread_mutex_lock(&lock);
+  fillFrame(blockNumber, buffer);
+  pthread_mutex_unlock(&lock);
+}
+
+void BufferCache::readBlocks(const unsigned int *blockNumbers, int numBlocks, void *buffer) {
+  unsigned char *dst = (unsigned char *) buffer;
+
+  // copy the hits out now and collect the misses for a single disk read
+  vector<unsigned int> missing;
+  vector<int> missingIndex;
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < numBlocks; i++) {
+    Frame *frame = findFrame(blockNumbers[i]);
+    if (frame != NULL) {
+      numHits++;
+      memcpy(dst + i * UFS_BLOCK_SIZE, frame->data, UFS_BLOCK_SIZE);
+    } else {
+      numMisses++;
+      missing.push_back(blockNumbers[i]);
+      missingIndex.push_back(i);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  if (missing.empty()) {
+    return;
+  }
+
+  vector<unsigned char> data(missing.size() * UFS_BLOCK_SIZE);
+  disk->readBlocks(missing.data(), missing.size(), data.data());
+  pthread_mutex_lock(&lock);
+  for (size_t idx = 0; idx < missing.size(); idx++) {
+    unsigned char *block = data.data() + idx * UFS_BLOCK_SIZE;
+    memcpy(dst + missingIndex[idx] * UFS_BLOCK_SIZE, block, UFS_BLOCK_SIZE);
+    fillFrame(missing[idx], block);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+long BufferCache::commit(const map<unsigned int, unsigned char *> &blocks) {
+  // queued first, so a miss in between reads the new contents back from
+  // the disk's pending blocks
+  long ticket = disk->queueCommit(blocks);
+  pthread_mutex_lock(&lock);
+  map<unsigned int, unsigned char *>::const_iterator iter;
+  for (iter = blocks.begin(); iter != blocks.end() && numFrames > 0; iter++) {
+    Frame *frame = findFrame(iter->first);
+    if (frame == NULL) {
+      frame = allocateFrame(iter->first);
+    }
+    memcpy(frame->data, iter->second, UFS_BLOCK_SIZE);
+  }
+  pthread_mutex_unlock(&lock);
+  return ticket;
+}
+
+void BufferCache::writeUnjournaled(const unsigned int *blockNumbers, int numBlocks, const void *buffer) {
+  disk->writeUnjournaled(blockNumbers, numBlocks, buffer);
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < numBlocks && !frames.empty(); i++) {
+    dropFrame(blockNumbers[i]);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void BufferCache::invalidate() {
+  pthread_mutex_lock(&lock);
+  while (lruHead != NULL) {
+    Frame *frame = lruHead;
+    unlinkFrame(frame);
+    freeFrames.push_back(frame);
+  }
+  frames.clear();
+  pthread_mutex_unlock(&lock);
+}
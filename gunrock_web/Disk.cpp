@@ -1,8 +1,14 @@
 #include <iostream>
+#include <algorithm>
 #include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -10,37 +16,128 @@
 #include <sys/mman.h>
 
 #include "Disk.h"
-#include "dthread.h"
+#include "ufs.h"
 
 using namespace std;
 
 Disk::Disk(string imageFile, int blockSize) {
+  bool useMmap = imageFile.compare(0, strlen(DISK_MMAP_PREFIX), DISK_MMAP_PREFIX) == 0;
+  if (useMmap) {
+    imageFile = imageFile.substr(strlen(DISK_MMAP_PREFIX));
+  }
+
   this->imageFile = imageFile;
   this->blockSize = blockSize;
+  this->numBlocksWritten = 0;
+  this->lastTicket = 0;
+  this->durableTicket = 0;
+  this->numPending = 0;
+  this->isCommitting = false;
+  this->firstUnjournaled = -1;
+  this->lastUnjournaled = -1;
+  pthread_mutex_init(&this->lock, NULL);
+  pthread_cond_init(&this->committed, NULL);
+  this->isReadOnly = false;
+  this->mappedImage = NULL;
+  this->firstDirtyBlock = -1;
+  this->lastDirtyBlock = -1;
 
-  struct stat stat;
-  int imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
-  if (imageFileDescriptor < 0) {
+  // keep the image open for the lifetime of the disk and do positional
+  // I/O on it, read-only images can still be used by the ds3 tools
+  this->imageFileDescriptor = open(imageFile.c_str(), O_RDWR);
+  if (this->imageFileDescriptor < 0 && (errno == EACCES || errno == EROFS)) {
+    this->imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
+    this->isReadOnly = true;
+  }
+  if (this->imageFileDescriptor < 0) {
     cerr << "could not open " << imageFile << endl;
     exit(1);
   }
-  int ret = fstat(imageFileDescriptor, &stat);
+
+  struct stat stat;
+  int ret = fstat(this->imageFileDescriptor, &stat);
   if (ret != 0) {
     cerr << "Could not stat image file" << endl;
     exit(1);
   }
-  close(imageFileDescriptor);
   
   this->imageFileSize = stat.st_size;
 
-  if ((this->imageFileSize % this->blockSize) != 0 || this->blockSize == 0) {
+  if (this->blockSize == 0 || (this->imageFileSize % this->blockSize) != 0) {
     cerr << "Your disk image size must be a multiple of your block size" << endl;
     cerr << "  imageSize: " << this->imageFileSize << endl;
     cerr << "  blockSize: " << this->blockSize << endl;
-    cerr << "  imageSize % blockSize: " << this->imageFileSize % this->blockSize << endl;
+    if (this->blockSize != 0) {
+      cerr << "  imageSize % blockSize: " << this->imageFileSize % this->blockSize << endl;
+    }
+    exit(1);
+  }
+
+  if (useMmap) {
+    int prot = this->isReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *image = mmap(NULL, this->imageFileSize, prot, MAP_SHARED, this->imageFileDescriptor, 0);
+    if (image == MAP_FAILED) {
+      perror("mmap");
+      cerr << "Could not map image file " << imageFile << endl;
+      exit(1);
+    }
+    this->mappedImage = (unsigned char *) image;
+  }
+
+  openJournal();
+}
+
+Disk::~Disk() {
+  // make the home locations durable so the journal is empty next time
+  if (this->journalLength > 0 && this->firstDirtyBlock >= 0) {
+    checkpointJournal();
+  }
+  pthread_mutex_destroy(&lock);
+  pthread_cond_destroy(&committed);
+  if (this->mappedImage != NULL) {
+    munmap(this->mappedImage, this->imageFileSize);
+  }
+  close(this->imageFileDescriptor);
+}
+
+// Make blocks that have been written durable. Mapped images only need
+// the written range flushed, for pread/pwrite images one fdatasync covers
+// everything written so far.
+void Disk::syncRange(int blockNumber, int numBlocks) {
+  if (this->mappedImage == NULL) {
+    if (fdatasync(this->imageFileDescriptor) != 0) {
+      perror("fdatasync");
+      cerr << "Could not sync image file" << endl;
+      exit(1);
+    }
+    return;
+  }
+  // msync wants a page aligned address
+  long pageSize = sysconf(_SC_PAGESIZE);
+  off_t start = (off_t) blockNumber * this->blockSize;
+  off_t end = start + (off_t) numBlocks * this->blockSize;
+  start -= start % pageSize;
+  if (msync(this->mappedImage + start, end - start, MS_SYNC) != 0) {
+    perror("msync");
+    cerr << "Could not sync image file" << endl;
     exit(1);
   }
-  
+}
+
+void Disk::markDirty(int blockNumber) {
+  if (firstDirtyBlock < 0) {
+    firstDirtyBlock = lastDirtyBlock = blockNumber;
+  } else {
+    firstDirtyBlock = min(firstDirtyBlock, blockNumber);
+    lastDirtyBlock = max(lastDirtyBlock, blockNumber);
+  }
+}
+
+void Disk::syncDirty() {
+  if (firstDirtyBlock >= 0) {
+    syncRange(firstDirtyBlock, lastDirtyBlock - firstDirtyBlock + 1);
+    firstDirtyBlock = lastDirtyBlock = -1;
+  }
 }
 
 int Disk::numberOfBlocks() {
@@ -48,94 +145,571 @@ int Disk::numberOfBlocks() {
 }
 
 void Disk::readBlock(int blockNumber, void *buffer) {
-  if (blockNumber < 0 || blockNumber > this->numberOfBlocks()) {
+  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
 
-  int fd = open(this->imageFile.c_str(), O_RDONLY);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
-    exit(1);
+  unsigned int block = blockNumber;
+  vector<bool> copied;
+  if (!copyPending(&block, 1, (unsigned char *) buffer, &copied)) {
+    readImage(blockNumber, buffer);
   }
+}
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
-    perror("read::lseek");
-    cerr << "Could not seek to file" << endl;
-    exit(1);
+// Copies the queued contents of any of the blocks that are not home yet
+// into their place in buffer. A block that is not pending when we look
+// is either home already or changed by a commit that has to wait for
+// the caller's locks, so reading it from the image afterwards is safe.
+// Returns false, without touching copied, if none of them were pending,
+// which usually doesn't even need the lock.
+bool Disk::copyPending(const unsigned int *blockNumbers, int numBlocks, unsigned char *buffer,
+                       vector<bool> *copied) {
+  if (__atomic_load_n(&numPending, __ATOMIC_ACQUIRE) == 0) {
+    return false;
   }
 
-  ret = read(fd, buffer, this->blockSize);
-  if (ret != this->blockSize) {
-    cerr << "Could not read file" << endl;
-    exit(1);
+  bool isCopied = false;
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < numBlocks && !pending.empty(); i++) {
+    map<unsigned int, unsigned char *>::iterator found = pending.find(blockNumbers[i]);
+    if (found != pending.end()) {
+      if (!isCopied) {
+        copied->assign(numBlocks, false);
+        isCopied = true;
+      }
+      memcpy(buffer + (size_t) i * this->blockSize, found->second, this->blockSize);
+      (*copied)[i] = true;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return isCopied;
+}
+
+void Disk::readBlocks(const unsigned int *blockNumbers, int numBlocks, void *buffer) {
+  unsigned char *dst = (unsigned char *) buffer;
+  for (int i = 0; i < numBlocks; i++) {
+    if ((int) blockNumbers[i] < 0 || (int) blockNumbers[i] >= this->numberOfBlocks()) {
+      cerr << "Invalid block number " << (int) blockNumbers[i] << endl;
+      exit(1);
+    }
+  }
+
+  vector<bool> copied;
+  if (!copyPending(blockNumbers, numBlocks, dst, &copied)) {
+    copied.assign(numBlocks, false);
   }
 
-  close(fd);
+  // one read per run of physically adjacent blocks that were not pending
+  for (int first = 0; first < numBlocks; ) {
+    if (copied[first]) {
+      first++;
+      continue;
+    }
+    int count = 1;
+    while (first + count < numBlocks && !copied[first + count] &&
+           blockNumbers[first + count] == blockNumbers[first] + count) {
+      count++;
+    }
+    struct iovec iov;
+    iov.iov_base = dst + (size_t) first * this->blockSize;
+    iov.iov_len = (size_t) count * this->blockSize;
+    transferImage(false, blockNumbers[first], &iov, 1);
+    first += count;
+  }
+}
+
+void Disk::readImage(int blockNumber, void *buffer) {
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = this->blockSize;
+  transferImage(false, blockNumber, &iov, 1);
 }
 
 void Disk::writeBlock(int blockNumber, void *buffer) {  
-  if (blockNumber < 0 || blockNumber > this->numberOfBlocks()) {
+  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
 
-  if (isInTransaction) {
-    struct UndoRecord undoRecord;
-    undoRecord.blockNumber = blockNumber;
-    undoRecord.blockData = new unsigned char[blockSize];
-    this->readBlock(blockNumber, undoRecord.blockData);
-    undoLog.push_front(undoRecord);
-  }
-  
-  int fd = open(this->imageFile.c_str(), O_RDWR);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
+  if (this->isReadOnly) {
+    cerr << "Could not write file: " << this->imageFile << " is read-only" << endl;
     exit(1);
   }
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
-    perror("write::lseek");
-    cerr << "Could not seek to file" << endl;
+  writeImage(blockNumber, buffer);
+  syncRange(blockNumber, 1);
+}
+
+void Disk::writeBlocks(const unsigned int *blockNumbers, int numBlocks, const void *buffer) {
+  for (int i = 0; i < numBlocks; i++) {
+    if ((int) blockNumbers[i] < 0 || (int) blockNumbers[i] >= this->numberOfBlocks()) {
+      cerr << "Invalid block number " << (int) blockNumbers[i] << endl;
+      exit(1);
+    }
+  }
+  if (this->isReadOnly) {
+    cerr << "Could not write file: " << this->imageFile << " is read-only" << endl;
     exit(1);
   }
 
-  ret = write(fd, buffer, this->blockSize);
-  if (ret != this->blockSize) {
-    cerr << "Could not write file" << endl;
+  const unsigned char *src = (const unsigned char *) buffer;
+  for (int first = 0; first < numBlocks; ) {
+    int count = 1;
+    while (first + count < numBlocks && blockNumbers[first + count] == blockNumbers[first] + count) {
+      count++;
+    }
+    struct iovec iov;
+    iov.iov_base = (void *) (src + (size_t) first * this->blockSize);
+    iov.iov_len = (size_t) count * this->blockSize;
+    transferImage(true, blockNumbers[first], &iov, 1);
+    markDirty(blockNumbers[first]);
+    markDirty(blockNumbers[first] + count - 1);
+    first += count;
+  }
+  syncDirty();
+}
+
+void Disk::writeImage(int blockNumber, const void *buffer) {
+  struct iovec iov;
+  iov.iov_base = (void *) buffer;
+  iov.iov_len = this->blockSize;
+  transferImage(true, blockNumber, &iov, 1);
+}
+
+// Read or write the image starting at blockNumber, scattering to or
+// gathering from iov, with as few preadv/pwritev calls as possible.
+void Disk::transferImage(bool isWrite, int blockNumber, struct iovec *iov, int iovcnt) {
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  if (isWrite) {
+    // unjournaled writes run alongside the thread writing commits
+    for (int i = 0; i < iovcnt; i++) {
+      __sync_fetch_and_add(&this->numBlocksWritten, iov[i].iov_len / this->blockSize);
+    }
+  }
+
+  if (this->mappedImage != NULL) {
+    for (int i = 0; i < iovcnt; i++) {
+      if (isWrite) {
+        memcpy(this->mappedImage + offset, iov[i].iov_base, iov[i].iov_len);
+      } else {
+        memcpy(iov[i].iov_base, this->mappedImage + offset, iov[i].iov_len);
+      }
+      offset += iov[i].iov_len;
+    }
+    return;
+  }
+
+  // short transfers leave us part way through an iovec, so work on a
+  // copy that can be advanced. Single block reads and writes, the common
+  // case, keep theirs on the stack.
+  struct iovec single;
+  vector<struct iovec> copies;
+  if (iovcnt == 1) {
+    single = iov[0];
+  } else {
+    copies.assign(iov, iov + iovcnt);
+  }
+  struct iovec *left = iovcnt == 1 ? &single : copies.data();
+  int idx = 0;
+  while (idx < iovcnt) {
+    int count = min(iovcnt - idx, IOV_MAX);
+    ssize_t ret = isWrite ?
+      pwritev(this->imageFileDescriptor, &left[idx], count, offset) :
+      preadv(this->imageFileDescriptor, &left[idx], count, offset);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      perror(isWrite ? "write::pwritev" : "read::preadv");
+      cerr << (isWrite ? "Could not write file" : "Could not read file") << endl;
+      exit(1);
+    }
+    offset += ret;
+    while (ret > 0) {
+      if ((size_t) ret >= left[idx].iov_len) {
+        ret -= left[idx].iov_len;
+        idx++;
+      } else {
+        left[idx].iov_base = (unsigned char *) left[idx].iov_base + ret;
+        left[idx].iov_len -= ret;
+        ret = 0;
+      }
+    }
+  }
+}
+
+long Disk::queueCommit(const map<unsigned int, unsigned char *> &blocks) {
+  if (blocks.empty()) {
+    return 0;
+  }
+  if (this->isReadOnly) {
+    cerr << "Could not write file: " << this->imageFile << " is read-only" << endl;
     exit(1);
   }
-  fsync(fd);
-  close(fd);
+
+  Commit *commit = new Commit;
+  map<unsigned int, unsigned char *>::const_iterator iter;
+  for (iter = blocks.begin(); iter != blocks.end(); iter++) {
+    if ((int) iter->first < 0 || (int) iter->first >= this->numberOfBlocks()) {
+      cerr << "Invalid block number " << (int) iter->first << endl;
+      exit(1);
+    }
+    unsigned char *data = new unsigned char[this->blockSize];
+    memcpy(data, iter->second, this->blockSize);
+    commit->blocks[iter->first] = data;
+  }
+
+  pthread_mutex_lock(&lock);
+  commit->ticket = ++lastTicket;
+  queued.push_back(commit);
+  for (iter = commit->blocks.begin(); iter != commit->blocks.end(); iter++) {
+    pending[iter->first] = iter->second;
+  }
+  __atomic_store_n(&numPending, (long) pending.size(), __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&lock);
+  return commit->ticket;
 }
 
-void Disk::beginTransaction() {
-  if (isInTransaction) {
-    cerr << "You can't start a new transaction: one already exists" << endl;
+void Disk::waitForCommit(long ticket) {
+  pthread_mutex_lock(&lock);
+  while (durableTicket < ticket) {
+    if (isCommitting) {
+      pthread_cond_wait(&committed, &lock);
+      continue;
+    }
+
+    // nobody is writing, so this thread writes everything queued so far
+    isCommitting = true;
+    vector<Commit *> batch;
+    batch.swap(queued);
+    int first = firstUnjournaled;
+    int last = lastUnjournaled;
+    firstUnjournaled = lastUnjournaled = -1;
+    pthread_mutex_unlock(&lock);
+    writeCommits(batch, first, last);
+    pthread_mutex_lock(&lock);
+
+    // blocks are home now unless a later commit queued them again
+    for (size_t i = 0; i < batch.size(); i++) {
+      map<unsigned int, unsigned char *>::iterator iter;
+      for (iter = batch[i]->blocks.begin(); iter != batch[i]->blocks.end(); iter++) {
+        map<unsigned int, unsigned char *>::iterator found = pending.find(iter->first);
+        if (found != pending.end() && found->second == iter->second) {
+          pending.erase(found);
+        }
+        delete [] iter->second;
+      }
+      durableTicket = batch[i]->ticket;
+      delete batch[i];
+    }
+    __atomic_store_n(&numPending, (long) pending.size(), __ATOMIC_RELEASE);
+    isCommitting = false;
+    pthread_cond_broadcast(&committed);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void Disk::commit(const map<unsigned int, unsigned char *> &blocks) {
+  waitForCommit(queueCommit(blocks));
+}
+
+void Disk::waitUntilHome(const unsigned int *blockNumbers, int numBlocks) {
+  long ticket = 0;
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < numBlocks && !pending.empty(); i++) {
+    if (pending.count(blockNumbers[i]) > 0) {
+      ticket = lastTicket;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  waitForCommit(ticket);
+}
+
+void Disk::writeUnjournaled(const unsigned int *blockNumbers, int numBlocks, const void *buffer) {
+  for (int i = 0; i < numBlocks; i++) {
+    if ((int) blockNumbers[i] < 0 || (int) blockNumbers[i] >= this->numberOfBlocks()) {
+      cerr << "Invalid block number " << (int) blockNumbers[i] << endl;
+      exit(1);
+    }
+  }
+  if (this->isReadOnly) {
+    cerr << "Could not write file: " << this->imageFile << " is read-only" << endl;
     exit(1);
   }
-  isInTransaction = true;
+
+  // a commit from before the blocks were freed may not have written
+  // them home yet, and would overwrite them when it does
+  waitUntilHome(blockNumbers, numBlocks);
+
+  const unsigned char *src = (const unsigned char *) buffer;
+  int first = INT_MAX;
+  int last = -1;
+  for (int start = 0; start < numBlocks; ) {
+    int count = 1;
+    while (start + count < numBlocks && blockNumbers[start + count] == blockNumbers[start] + count) {
+      count++;
+    }
+    struct iovec iov;
+    iov.iov_base = (void *) (src + (size_t) start * this->blockSize);
+    iov.iov_len = (size_t) count * this->blockSize;
+    transferImage(true, blockNumbers[start], &iov, 1);
+    first = min(first, (int) blockNumbers[start]);
+    last = max(last, (int) blockNumbers[start] + count - 1);
+    start += count;
+  }
+  if (last < 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  firstUnjournaled = firstUnjournaled < 0 ? first : min(firstUnjournaled, first);
+  lastUnjournaled = max(lastUnjournaled, last);
+  pthread_mutex_unlock(&lock);
+}
+
+// Writes a batch of queued commits, in queue order, as one transaction.
+// firstUnjournaled to lastUnjournaled is the range writeUnjournaled has
+// written for them, -1 if it wrote nothing.
+void Disk::writeCommits(const vector<Commit *> &batch, int firstUnjournaled, int lastUnjournaled) {
+  map<unsigned int, unsigned char *> blocks;
+  for (size_t i = 0; i < batch.size(); i++) {
+    map<unsigned int, unsigned char *>::iterator iter;
+    for (iter = batch[i]->blocks.begin(); iter != batch[i]->blocks.end(); iter++) {
+      blocks[iter->first] = iter->second;
+    }
+  }
+
+  int numBlocks = blocks.size();
+  bool useJournal = journalLength > 0 &&
+    numBlocks <= (int) JOURNAL_DESCRIPTOR_ENTRIES && numBlocks + 3 <= journalLength;
+
+  // Unjournaled blocks have to be durable before the commit that points
+  // at them, and older copies of them in the journal must not be
+  // replayed after it, so they are synced by emptying the journal.
+  if (firstUnjournaled >= 0) {
+    markDirty(firstUnjournaled);
+    markDirty(lastUnjournaled);
+  }
+
+  if (useJournal) {
+    if (firstUnjournaled >= 0 || journalHead + numBlocks + 2 > journalLength) {
+      checkpointJournal();
+    }
+    appendJournal(blocks);
+  } else if (journalLength > 0) {
+    // too big for the journal, so it goes straight home. Anything still
+    // in the journal has to be home first or recovery would replay it
+    // over this transaction.
+    checkpointJournal();
+  }
+
+  // the journal has the transaction now, so home writes can be synced
+  // lazily at the next checkpoint. The blocks are sorted by number, so
+  // each run of adjacent blocks goes out in one pwritev.
+  vector<struct iovec> iov;
+  map<unsigned int, unsigned char *>::iterator iter = blocks.begin();
+  while (iter != blocks.end()) {
+    int first = iter->first;
+    iov.clear();
+    do {
+      struct iovec vec;
+      vec.iov_base = iter->second;
+      vec.iov_len = this->blockSize;
+      iov.push_back(vec);
+      iter++;
+    } while (iter != blocks.end() && (int) iter->first == first + (int) iov.size());
+    transferImage(true, first, iov.data(), iov.size());
+    markDirty(first);
+    markDirty(first + iov.size() - 1);
+  }
+  if (!useJournal) {
+    syncDirty();
+  }
+}
+
+/********************************* Journal **********************************/
+
+static unsigned int journalChecksum(unsigned int sum, const void *data, int len) {
+  // FNV-1a
+  const unsigned char *bytes = (const unsigned char *) data;
+  for (int i = 0; i < len; i++) {
+    sum ^= bytes[i];
+    sum *= 16777619;
+  }
+  return sum;
+}
+
+void Disk::openJournal() {
+  journalAddress = 0;
+  journalLength = 0;
+  journalHead = 1;
+  journalSequence = 1;
+
+  // the journal location lives in the file system super block
+  if (this->blockSize != UFS_BLOCK_SIZE || this->numberOfBlocks() == 0) {
+    return;
+  }
+  unsigned char buffer[UFS_BLOCK_SIZE];
+  readImage(0, buffer);
+  super_t super;
+  memcpy(&super, buffer, sizeof(super_t));
+
+  if (super.journal_len < 3 || super.journal_addr <= 0 ||
+      super.journal_addr + super.journal_len > this->numberOfBlocks()) {
+    return;
+  }
+  journalAddress = super.journal_addr;
+  journalLength = super.journal_len;
+
+  recoverJournal();
 }
 
-void Disk::commit() {
-  isInTransaction = false;
-  deque<struct UndoRecord>::iterator iter;
-  for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
-    delete [] iter->blockData;
+void Disk::recoverJournal() {
+  unsigned char buffer[UFS_BLOCK_SIZE];
+  journal_header_t header;
+
+  readImage(journalAddress, buffer);
+  memcpy(&header, buffer, sizeof(header));
+  if (header.magic != UFS_JOURNAL_MAGIC || header.type != UFS_JOURNAL_SUPER) {
+    // a fresh journal from mkfs
+    if (!isReadOnly) {
+      resetJournal(1);
+    }
+    return;
+  }
+
+  unsigned int sequence = header.sequence;
+  int position = 1;
+  int replayed = 0;
+  while (position + 2 <= journalLength) {
+    unsigned char descriptor[UFS_BLOCK_SIZE];
+    readImage(journalAddress + position, descriptor);
+    memcpy(&header, descriptor, sizeof(header));
+    if (header.magic != UFS_JOURNAL_MAGIC || header.type != UFS_JOURNAL_DESCRIPTOR ||
+        header.sequence != sequence || header.num_blocks == 0 ||
+        header.num_blocks > JOURNAL_DESCRIPTOR_ENTRIES ||
+        position + (int) header.num_blocks + 2 > journalLength) {
+      break;
+    }
+    int numBlocks = header.num_blocks;
+    unsigned int *blockNumbers = (unsigned int *) (descriptor + sizeof(journal_header_t));
+
+    unsigned int sum = journalChecksum(2166136261u, descriptor, UFS_BLOCK_SIZE);
+    unsigned char *contents = new unsigned char[numBlocks * UFS_BLOCK_SIZE];
+    struct iovec iov;
+    iov.iov_base = contents;
+    iov.iov_len = numBlocks * UFS_BLOCK_SIZE;
+    transferImage(false, journalAddress + position + 1, &iov, 1);
+    sum = journalChecksum(sum, contents, numBlocks * UFS_BLOCK_SIZE);
+
+    readImage(journalAddress + position + numBlocks + 1, buffer);
+    memcpy(&header, buffer, sizeof(header));
+    bool committed = header.magic == UFS_JOURNAL_MAGIC && header.type == UFS_JOURNAL_COMMIT &&
+      header.sequence == sequence && header.checksum == sum;
+    for (int i = 0; committed && i < numBlocks; i++) {
+      if ((int) blockNumbers[i] >= journalAddress || (int) blockNumbers[i] >= this->numberOfBlocks()) {
+        committed = false;
+      }
+    }
+
+    if (committed && !isReadOnly) {
+      for (int i = 0; i < numBlocks; i++) {
+        writeImage(blockNumbers[i], contents + i * UFS_BLOCK_SIZE);
+        markDirty(blockNumbers[i]);
+      }
+    }
+    delete [] contents;
+    if (!committed) {
+      break;
+    }
+
+    replayed++;
+    position += numBlocks + 2;
+    sequence++;
+  }
+
+  if (replayed > 0 && isReadOnly) {
+    cerr << "warning: " << imageFile << " has " << replayed
+         << " journaled transactions that cannot be replayed on a read-only image" << endl;
+    journalLength = 0;
+    return;
+  }
+
+  journalSequence = sequence;
+  if (replayed > 0) {
+    checkpointJournal();
+  } else {
+    journalHead = 1;
   }
-  undoLog.clear();
 }
 
-void Disk::rollback() {
-  isInTransaction = false;
-  deque<struct UndoRecord>::iterator iter;
-  for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
-    this->writeBlock(iter->blockNumber, iter->blockData);
-    delete [] iter->blockData;
+void Disk::resetJournal(unsigned int sequence) {
+  unsigned char buffer[UFS_BLOCK_SIZE];
+  memset(buffer, 0, sizeof(buffer));
+  journal_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = UFS_JOURNAL_MAGIC;
+  header.type = UFS_JOURNAL_SUPER;
+  header.sequence = sequence;
+  memcpy(buffer, &header, sizeof(header));
+
+  writeImage(journalAddress, buffer);
+  syncRange(journalAddress, 1);
+  journalHead = 1;
+}
+
+// Make every transaction in the journal durable at home and empty it
+void Disk::checkpointJournal() {
+  syncDirty();
+  resetJournal(journalSequence);
+}
+
+void Disk::appendJournal(const map<unsigned int, unsigned char *> &blocks) {
+  int numBlocks = blocks.size();
+  unsigned char buffer[UFS_BLOCK_SIZE];
+  journal_header_t header;
+
+  memset(buffer, 0, sizeof(buffer));
+  memset(&header, 0, sizeof(header));
+  header.magic = UFS_JOURNAL_MAGIC;
+  header.type = UFS_JOURNAL_DESCRIPTOR;
+  header.sequence = journalSequence;
+  header.num_blocks = numBlocks;
+  memcpy(buffer, &header, sizeof(header));
+  unsigned int *blockNumbers = (unsigned int *) (buffer + sizeof(journal_header_t));
+  map<unsigned int, unsigned char *>::const_iterator iter;
+  int idx = 0;
+  for (iter = blocks.begin(); iter != blocks.end(); iter++) {
+    blockNumbers[idx++] = iter->first;
+  }
+
+  // the descriptor, the block contents and the commit block are
+  // adjacent in the journal, so they all go out in one pwritev
+  vector<struct iovec> iov(numBlocks + 2);
+  unsigned int sum = journalChecksum(2166136261u, buffer, UFS_BLOCK_SIZE);
+  iov[0].iov_base = buffer;
+  iov[0].iov_len = UFS_BLOCK_SIZE;
+  idx = 1;
+  for (iter = blocks.begin(); iter != blocks.end(); iter++, idx++) {
+    sum = journalChecksum(sum, iter->second, UFS_BLOCK_SIZE);
+    iov[idx].iov_base = iter->second;
+    iov[idx].iov_len = UFS_BLOCK_SIZE;
   }
-  undoLog.clear();
+
+  unsigned char commitBlock[UFS_BLOCK_SIZE];
+  memset(commitBlock, 0, sizeof(commitBlock));
+  header.type = UFS_JOURNAL_COMMIT;
+  header.checksum = sum;
+  memcpy(commitBlock, &header, sizeof(header));
+  iov[numBlocks + 1].iov_base = commitBlock;
+  iov[numBlocks + 1].iov_len = UFS_BLOCK_SIZE;
+
+  int position = journalAddress + journalHead;
+  transferImage(true, position, iov.data(), iov.size());
+
+  syncRange(position, numBlocks + 2);
+  journalHead += numBlocks + 2;
+  journalSequence++;
 }
@@ -8,21 +8,184 @@
 #include <string>
 #include <algorithm>
 #include <cstring>
+#include <climits>
 #include <vector>
 
 #include "DistributedFileSystemService.h"
 #include "ClientError.h"
 #include "ufs.h"
 #include "WwwFormEncodedDict.h"
+#include "StringUtils.h"
+#include "HttpUtils.h"
 
 
 using namespace std;
 
-DistributedFileSystemService::DistributedFileSystemService(string diskFile) : HttpService("/ds3/")
+DistributedFileSystemService::DistributedFileSystemService(string diskFile, int cacheBlocks) : HttpService("/ds3/")
 {
-  this->fileSystem = new LocalFileSystem(new Disk(diskFile, UFS_BLOCK_SIZE));
+  //the file system does its own locking, so requests run in parallel
+  this->fileSystem = new LocalFileSystem(new Disk(diskFile, UFS_BLOCK_SIZE), cacheBlocks);
 }  
 
+//turns LocalFileSystem errors from a PUT into the matching client error
+static void checkResult(int result)
+{
+    if (result == -ENOTENOUGHSPACE) 
+    {
+        throw ClientError::insufficientStorage();
+    }
+    if (result == -EREADONLY) 
+    {
+        throw ClientError::forbidden();
+    }
+    if (result == -EINVALIDSIZE || result == -EINVALIDNAME) 
+    {
+        throw ClientError::badRequest();
+    }
+    if (result < 0) 
+    {
+        throw ClientError::notFound();
+    }
+}
+
+//takes a PUT body as it is read and appends it to the file a block at a time,
+//so only one block of it is ever in memory
+class FileUpload : public BodySink
+{
+public:
+    FileUpload(LocalFileSystem *fileSystem, int inodeNumber) :
+      fileSystem(fileSystem), inodeNumber(inodeNumber), used(0), result(0) {}
+
+    virtual void onBody(const char *data, size_t len)
+    {
+        while (len > 0 && result >= 0) 
+        {
+            size_t bytes = min(len, sizeof(block) - used);
+            memcpy(block + used, data, bytes);
+            used += bytes;
+            data += bytes;
+            len -= bytes;
+            if (used == sizeof(block)) 
+            {
+                flush();
+            }
+        }
+        //after an error the rest of the body is thrown away
+    }
+
+    //writes what is left over, returns the first error or 0
+    int finish()
+    {
+        if (used > 0 && result >= 0) 
+        {
+            flush();
+        }
+        return result;
+    }
+
+private:
+    void flush()
+    {
+        int ret = fileSystem->append(inodeNumber, block, used);
+        if (ret < 0) 
+        {
+            result = ret;
+        }
+        used = 0;
+    }
+
+    LocalFileSystem *fileSystem;
+    int inodeNumber;
+    char block[UFS_BLOCK_SIZE];
+    size_t used;
+    int result;
+};
+
+//If-None-Match wins over If-Modified-Since when a request has both, and
+//entity tags are compared weakly
+static bool isNotModified(HTTPRequest *request, const string &etag, long mtime)
+{
+    string header;
+    if (request->findHeader("If-None-Match", &header)) 
+    {
+        string tag = etag.substr(2);
+        vector<string> candidates = StringUtils::split(header, ',');
+        for (size_t i = 0; i < candidates.size(); i++) 
+        {
+            string candidate = candidates[i];
+            candidate.erase(0, candidate.find_first_not_of(" \t"));
+            candidate.erase(candidate.find_last_not_of(" \t") + 1);
+            if (candidate.compare(0, 2, "W/") == 0) 
+            {
+                candidate = candidate.substr(2);
+            }
+            if (candidate == "*" || candidate == tag) 
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (mtime > 0 && request->findHeader("If-Modified-Since", &header)) 
+    {
+        time_t since = HttpUtils::parseDate(header);
+        return since >= 0 && mtime <= since;
+    }
+    return false;
+}
+
+//streams a file for a GET, keeping it open until the response is done with it
+class FileDownload : public BodySource
+{
+public:
+    FileDownload(LocalFileSystem *fileSystem, int inodeNumber) :
+      fileSystem(fileSystem), inodeNumber(inodeNumber), offset(0) {}
+
+    //start the body part way into the file, for a range
+    void seek(int position)
+    {
+        offset = position;
+    }
+
+    virtual ~FileDownload()
+    {
+        fileSystem->closeFile(inodeNumber);
+    }
+
+    virtual int read(char *buffer, int size)
+    {
+        int bytes = fileSystem->readAt(inodeNumber, buffer, size, offset);
+        if (bytes < 0) 
+        {
+            return -1;
+        }
+        offset += bytes;
+        return bytes;
+    }
+
+    //the file's blocks go out straight from the disk image a run of
+    //adjacent ones at a time
+    virtual long nextExtent(int *fd, off_t *imageOffset, long size)
+    {
+        long position;
+        int bytes = fileSystem->getFileExtent(inodeNumber, offset, (int) min(size, (long) INT_MAX), &position);
+        if (bytes <= 0)
+        {
+            return bytes < 0 ? -1 : 0;
+        }
+        *fd = fileSystem->disk->fileDescriptor();
+        *imageOffset = position;
+        offset += bytes;
+        return bytes;
+    }
+
+private:
+    LocalFileSystem *fileSystem;
+    int inodeNumber;
+    int offset;
+};
+
 //this function similar to ls
 void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response) 
 {
@@ -47,15 +210,24 @@ void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *respo
         current = next;
     }
     
+    //the file stays open while the response streams it, so the whole
+    //response comes from one version of it
+    if (fileSystem->openFile(current) < 0) 
+    {
+        throw ClientError::notFound();
+    }
+    FileDownload *download = new FileDownload(fileSystem, current);
+
     inode_t inode;
     fileSystem->stat(current, &inode);
     
     if (inode.type == UFS_DIRECTORY) 
     {
-        // directory listing
+        // directory listing, built while the directory is still open so
+        // nothing changes it halfway through
         string out;
-        vector<dir_ent_t> entries(inode.size / sizeof(dir_ent_t));
-        fileSystem->read(current, entries.data(), inode.size);
+        vector<dir_ent_t> entries;
+        fileSystem->readDirectory(current, &entries);
         
         //entry sorting by name
         sort(entries.begin() + 2, entries.end(), [](const dir_ent_t& a, const dir_ent_t& b) {return strcmp(a.name, b.name) < 0;});
@@ -71,22 +243,76 @@ void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *respo
             }
             out += "\n";
         }
+        delete download;
         response->setBody(out);
     } 
     else 
     {
-        //hand file contents
-        char buffer[inode.size];
-        fileSystem->read(current, buffer, inode.size);
-        //string fileContent(buffer.begin(), buffer.end());
-        string str(buffer);
-        response->setBody(str);
+        //validators come from the inode alone, so revalidating a file
+        //doesn't read any of its blocks. mtimes only have seconds, but a
+        //PUT always writes into newly allocated blocks, so the first one
+        //tells apart two PUTs in the same second. Other writes can reuse
+        //blocks, which makes the tag weak.
+        long mtime = fileSystem->modificationTime(&inode);
+        char etag[64];
+        snprintf(etag, sizeof(etag), "W/\"%x-%x-%lx-%x\"", current, inode.size, mtime,
+                 inode.size > 0 ? inode.direct[0] : 0);
+        response->setHeader("ETag", etag);
+        response->setHeader("Accept-Ranges", "bytes");
+        if (mtime > 0) 
+        {
+            response->setHeader("Last-Modified", HttpUtils::formatDate(mtime));
+        }
+
+        if (isNotModified(request, etag, mtime)) 
+        {
+            delete download;
+            response->setStatus(304);
+            return;
+        }
+
+        //file contents, a block at a time, without the NUL a PUT ends them with
+        long length = inode.size;
+        char last = 1;
+        if (length > 0 && fileSystem->readAt(current, &last, 1, length - 1) == 1 && last == '\0') 
+        {
+            length--;
+        }
+
+        //a range is only served if the file is still the one If-Range names
+        string range, ifRange;
+        long first = 0, end = length - 1;
+        int ranged = -1;
+        if (request->findHeader("Range", &range) &&
+            (!request->findHeader("If-Range", &ifRange) ||
+             (mtime > 0 && ifRange == HttpUtils::formatDate(mtime)))) 
+        {
+            ranged = HttpUtils::parseRange(range, length, &first, &end);
+        }
+
+        char contentRange[64];
+        if (ranged == 0) 
+        {
+            delete download;
+            snprintf(contentRange, sizeof(contentRange), "bytes */%ld", length);
+            response->setHeader("Content-Range", contentRange);
+            response->setStatus(416);
+            return;
+        }
+        if (ranged == 1) 
+        {
+            snprintf(contentRange, sizeof(contentRange), "bytes %ld-%ld/%ld", first, end, length);
+            response->setHeader("Content-Range", contentRange);
+            response->setStatus(206);
+            download->seek(first);
+        }
+        response->setBodySource(download, end - first + 1);
     }
 }
 
 void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *response) //done
 {
-    fileSystem->disk->beginTransaction();
+    fileSystem->beginTransaction();
 
     try {
         //function from httprequest
@@ -109,6 +335,7 @@ void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *respo
                 {
                     throw ClientError::conflict();
                 }
+                checkResult(childInodeNumber);
                 parentInodeNumber = childInodeNumber;
             }
             //when this is the last, create create a regular file
@@ -119,20 +346,28 @@ void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *respo
                 {
                     throw ClientError::conflict();
                 }
-                //write request
-                string requestBody = request->getBody();
-                fileSystem->write(childInodeNumber, requestBody.c_str(), requestBody.length() + 1);
+                checkResult(childInodeNumber);
+                //empty the file and stream the body into it, ending with a
+                //NUL like the contents always have
+                checkResult(fileSystem->write(childInodeNumber, NULL, 0));
+                FileUpload upload(fileSystem, childInodeNumber);
+                if (!request->readBody(&upload)) 
+                {
+                    throw ClientError::badRequest();
+                }
+                upload.onBody("", 1);
+                checkResult(upload.finish());
             }
         }
     }
     catch (...) 
     {
       //rollback if error
-      fileSystem->disk->rollback();
+      fileSystem->rollback();
       throw;
     }
     //if nothing happens then commit
-    fileSystem->disk->commit();
+    fileSystem->commit();
     response->setBody("");
 } 
 
@@ -152,7 +387,7 @@ void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *respo
         }
     }
 
-    fileSystem->disk->beginTransaction();
+    fileSystem->beginTransaction();
     try {
         //deleting the object
         int deleteResult = fileSystem->unlink(parentInodeNum, dir_ent_name);
@@ -177,12 +412,41 @@ void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *respo
         {
           throw ClientError::insufficientStorage();
         } 
-        fileSystem->disk->commit();
+        else if (deleteResult == -EREADONLY) 
+        {
+          throw ClientError::forbidden();
+        } 
+        fileSystem->commit();
     } 
     catch (const ClientError &e) 
     {
         response->setStatus(e.status_code);
         response->setBody(e.what());
-        fileSystem->disk->rollback();
+        fileSystem->rollback();
     }
-}
\ No newline at end of file
+}
+
+//size of the file a GET would return, directories count as empty
+long DistributedFileSystemService::sizeHint(string path) 
+{
+    vector<string> pathComponents = StringUtils::split(path, '/');
+
+    //this runs on the event loop, which must not wait for inode locks, so
+    //only paths the dentry cache knows get a size
+    int current = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+    for (size_t i = 1; i < pathComponents.size(); ++i) 
+    {
+        current = fileSystem->cachedLookup(current, pathComponents[i]);
+        if (current < 0) 
+        {
+            return 0;
+        }
+    }
+
+    inode_t inode;
+    if (fileSystem->stat(current, &inode) < 0 || inode.type != UFS_REGULAR_FILE) 
+    {
+        return 0;
+    }
+    return inode.size;
+}
@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include <iostream>
 #include <map>
@@ -30,37 +31,54 @@ bool FileService::endswith(string str, string suffix) {
   return pos == (str.length() - suffix.length());
 }
 
-void FileService::get(HTTPRequest *request, HTTPResponse *response) {
-  string path = this->m_basedir + request->getPath();
-  string fileContents = this->readFile(path);
-  if (fileContents.size() == 0) {
-    throw ClientError::notFound();
-  } else {
-    if (this->endswith(path, ".css")) {
-      response->setContentType("text/css");
-    } else if (this->endswith(path, ".js")) {
-      response->setContentType("text/javascript");
+// Streams a static file from its descriptor, which it closes
+class FileSource : public BodySource {
+ public:
+  FileSource(int fd) : fd(fd), offset(0) {}
+
+  virtual ~FileSource() {
+    close(fd);
+  }
+
+  virtual int read(char *buffer, int size) {
+    int ret = pread(fd, buffer, size, offset);
+    if (ret > 0) {
+      offset += ret;
     }
-    response->setBody(fileContents);
+    return ret;
   }
-}
 
-string FileService::readFile(string path) {
+  // the whole file is one extent, sendfile stops short if it shrinks
+  virtual long nextExtent(int *fd, off_t *offset, long size) {
+    *fd = this->fd;
+    *offset = this->offset;
+    this->offset += size;
+    return size;
+  }
+
+ private:
+  int fd;
+  off_t offset;
+};
+
+void FileService::get(HTTPRequest *request, HTTPResponse *response) {
+  string path = this->m_basedir + request->getPath();
   int fd = open(path.c_str(), O_RDONLY);
   if (fd < 0) {
-    return "";
+    throw ClientError::notFound();
   }
-
-  string result;
-  int ret;
-  char buffer[4096];
-  while ((ret = read(fd, buffer, sizeof(buffer))) > 0) {
-    result.append(buffer, ret);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    throw ClientError::notFound();
   }
 
-  close(fd);
-  
-  return result;
+  if (this->endswith(path, ".css")) {
+    response->setContentType("text/css");
+  } else if (this->endswith(path, ".js")) {
+    response->setContentType("text/javascript");
+  }
+  response->setBodySource(new FileSource(fd), st.st_size);
 }
 
 void FileService::head(HTTPRequest *request, HTTPResponse *response) {
@@ -68,3 +86,11 @@ void FileService::head(HTTPRequest *request, HTTPResponse *response) {
   this->get(request, response);
   response->setBody("");
 }
+
+long FileService::sizeHint(string path) {
+  struct stat st;
+  if (stat((this->m_basedir + path).c_str(), &st) != 0) {
+    return 0;
+  }
+  return st.st_size;
+}
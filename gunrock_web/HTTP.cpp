@@ -40,11 +40,14 @@ int HTTP::url_cb(http_parser *parser, const char *at, size_t length)
     return 0;
 }
 
-int HTTP::fragment_cb(http_parser */*parser*/, const char */*at*/, size_t /*length*/)
+// Clients never send fragments, so a URL with one is a malformed request.
+// Stopping the parser here makes addData fail, and the connection is
+// closed rather than the server aborting.
+int HTTP::fragment_cb(http_parser *parser, const char */*at*/, size_t /*length*/)
 {
-    cout << "fragment" << endl;
-    assert(false);
-    return 0;
+    HTTP *http = (HTTP *) parser->data;
+    http->setState(HTTP::ERROR);
+    return 1;
 }
 
 int HTTP::header_field_cb(http_parser *parser, const char *at, size_t length)
@@ -80,6 +83,10 @@ int HTTP::headers_complete_cb(http_parser *parser)
     HTTP *http = (HTTP *) parser->data;
     http->addHeaderField();
     http->m_headerDone = true;
+    // requests are handled once their headers are in, before the body
+    if(http->m_httpType == HTTP_REQUEST) {
+        http->m_method = parser->method;
+    }
 
     if(http->m_httpType == HTTP_RESPONSE) {
         char buf[64];
@@ -119,7 +126,11 @@ int HTTP::headers_complete_cb(http_parser *parser)
 int HTTP::body_cb(http_parser *parser, const char *at, size_t length)
 {
     HTTP *http = (HTTP *) parser->data;
-    http->m_body.append(at, length);
+    if(http->m_bodySink != NULL) {
+        http->m_bodySink->onBody(at, length);
+    } else {
+        http->m_body.append(at, length);
+    }
 
     return 0;
 }
@@ -127,10 +138,20 @@ int HTTP::body_cb(http_parser *parser, const char *at, size_t length)
 int HTTP::message_complete_cb(http_parser *parser)
 {
     HTTP *http = (HTTP *) parser->data;
+    // HEADER when the request had no header fields at all
     assert((http->getState() == HTTP::VALUE) || 
-           (http->getState() == HTTP::BODY));
+           (http->getState() == HTTP::BODY) ||
+           (http->getState() == HTTP::HEADER));
     http->setState(HTTP::DONE);
     http->messageComplete(parser->method);
+
+    // Stop at the end of a request so that anything after it, like a
+    // pipelined request, is left for the caller. Like in
+    // headers_complete_cb the parser doesn't count the byte it stopped on.
+    if(http->m_httpType == HTTP_REQUEST) {
+        http->m_extraParsedBytes = 1;
+        return -1;
+    }
     return 0;
 }
 
@@ -165,6 +186,7 @@ HTTP::HTTP(http_parser_type httpType)
     m_field = NULL;
     m_value = NULL;
     m_extraParsedBytes = 0;
+    m_bodySink = NULL;
 }
 
 HTTP::~HTTP()
@@ -189,6 +211,9 @@ int HTTP::addData(const unsigned char *data, int len)
         assert(false);
     }
     int ret = http_parser_execute(&m_parser, &m_settings, (const char *) data, len);
+    if(m_state == ERROR) {
+        return -1;
+    }
     ret += m_extraParsedBytes;
     m_extraParsedBytes = 0;
     return ret;
@@ -199,6 +224,15 @@ string HTTP::getBody()
     return m_body;
 }
 
+void HTTP::setBodySink(BodySink *sink)
+{
+    m_bodySink = sink;
+    if(sink != NULL && !m_body.empty()) {
+        sink->onBody(m_body.data(), m_body.size());
+        string().swap(m_body);
+    }
+}
+
 string HTTP::getUrl()
 {
     return m_url;
@@ -228,6 +262,11 @@ bool HTTP::isDone()
     return m_doneParsing;
 }
 
+bool HTTP::shouldKeepAlive()
+{
+    return http_should_keep_alive(&m_parser) != 0;
+}
+
 string HTTP::getReplyHeader()
 {
     string reply;
@@ -243,7 +282,6 @@ string HTTP::getReplyHeader()
         string value = *(m_headers[idx].second);
 
         if(field == "Connection") {
-            value = "close";
             foundConn = true;
         }
 
@@ -5,6 +5,8 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
+#include <strings.h>
 
 #include "HttpUtils.h"
 #include "StringUtils.h"
@@ -12,6 +14,7 @@
 using namespace std;
 
 #define CONNECT_REPLY "HTTP/1.1 200 Connection Established\r\n\r\n"
+#define CONTINUE_REPLY "HTTP/1.1 100 Continue\r\n\r\n"
 
 HTTPRequest::HTTPRequest(MySocket *sock, int serverPort)
 {
@@ -20,6 +23,7 @@ HTTPRequest::HTTPRequest(MySocket *sock, int serverPort)
     m_serverPort = serverPort;
     m_totalBytesRead = 0;
     m_totalBytesWritten = 0;
+    m_continueSent = false;
 }
 
 HTTPRequest::~HTTPRequest()
@@ -40,7 +44,7 @@ map<string, string> HTTPRequest::getParams() {
 }
 
 WwwFormEncodedDict HTTPRequest::formEncodedBody() {
-  WwwFormEncodedDict dict(m_http->getBody());
+  WwwFormEncodedDict dict(getBody());
   return dict;
 }
 
@@ -61,6 +65,17 @@ string HTTPRequest::getHeader(string key) {
   throw "could not find header";
 }
 
+bool HTTPRequest::findHeader(string key, string *value) {
+  vector<pair<string *, string *> > headers = m_http->getHeaders();
+  for (size_t idx = 0; idx < headers.size(); idx++) {
+    if (strcasecmp(headers[idx].first->c_str(), key.c_str()) == 0) {
+      *value = *headers[idx].second;
+      return true;
+    }
+  }
+  return false;
+}
+
 bool HTTPRequest::hasAuthToken() {
   try {
     getHeader("x-auth-token");
@@ -96,6 +111,76 @@ bool HTTPRequest::readRequest()
     return true;
 }
 
+int HTTPRequest::addData(const char *buffer, unsigned int len)
+{
+    unsigned int bytesRead = 0;
+    while(bytesRead < len && !m_http->isDone()) {
+        int ret = m_http->addData((const unsigned char *) (buffer + bytesRead), len - bytesRead);
+        if(ret <= 0) {
+            return -1;
+        }
+        bytesRead += ret;
+    }
+
+    m_totalBytesRead += bytesRead;
+    return bytesRead;
+}
+
+// Body sink for requests nobody wants the body of
+class DiscardBody : public BodySink {
+ public:
+    virtual void onBody(const char *data, size_t len) {}
+};
+
+void HTTPRequest::readRest()
+{
+    string expect;
+    if(!m_http->isDone() && !m_continueSent && findHeader("Expect", &expect) &&
+       strcasecmp(expect.c_str(), "100-continue") == 0) {
+        m_sock->write(CONTINUE_REPLY);
+        m_totalBytesWritten += strlen(CONTINUE_REPLY);
+        m_continueSent = true;
+    }
+
+    while(!m_http->isDone()) {
+        string data = m_sock->read();
+        int used = addData(data.data(), data.size());
+        if(used < 0) {
+            throw SocketReadError();
+        }
+        m_leftover.append(data, used, string::npos);
+    }
+}
+
+string HTTPRequest::getBody()
+{
+    if(!m_http->isDone()) {
+        readRest();
+    }
+    return m_http->getBody();
+}
+
+bool HTTPRequest::readBody(BodySink *sink)
+{
+    DiscardBody discard;
+    m_http->setBodySink(sink != NULL ? sink : &discard);
+    bool isRead = true;
+    try {
+        readRest();
+    } catch (...) {
+        isRead = false;
+    }
+    m_http->setBodySink(NULL);
+    return isRead;
+}
+
+string HTTPRequest::takeLeftover()
+{
+    string leftover;
+    leftover.swap(m_leftover);
+    return leftover;
+}
+
 void HTTPRequest::onRead(const char *buffer, unsigned int len)
 {
     m_totalBytesRead += len;
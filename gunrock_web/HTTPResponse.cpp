@@ -1,26 +1,48 @@
-#include <sstream>
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
 
 #include "HTTPResponse.h"
+#include "HttpUtils.h"
 
 using namespace std;
 
 HTTPResponse::HTTPResponse() {
   this->streaming = false;
   this->contentType = "text/html; charset=ISO-8859-1";
-  this->headers["Server"] = "Gunrock Web";
   this->status = 200;
+  this->source = NULL;
+  this->sourceLength = -1;
+  this->headLength = 0;
+}
+
+HTTPResponse::~HTTPResponse() {
+  delete source;
 }
 
 void HTTPResponse::withStreaming() {
   this->streaming = true;
 }
 
+void HTTPResponse::setBodySource(BodySource *source, long length) {
+  delete this->source;
+  this->source = source;
+  this->sourceLength = length;
+  this->streaming = length < 0;
+}
+
 void HTTPResponse::setHeader(string name, string value) {
   this->headers[name] = value;
 }
 
 void HTTPResponse::setBody(string data) {
   body = data;
+  if (source != NULL) {
+    delete source;
+    source = NULL;
+    streaming = false;
+  }
 }
 
 int HTTPResponse::getStatus() {
@@ -35,34 +57,153 @@ void HTTPResponse::setStatus(int status) {
   this->status = status;
 }
 
-string HTTPResponse::statusToString() {
+const char *HTTPResponse::statusToString() {
   if (status == 200) {
     return "OK";
+  } else if (status == 206) {
+    return "Partial Content";
+  } else if (status == 304) {
+    return "Not Modified";
+  } else if (status == 416) {
+    return "Range Not Satisfiable";
   } else {
     return "Unknown";
   }
 }
 
-string HTTPResponse::response() {
-  stringstream out;
-  setHeader("Content-Type", contentType);
-  if (streaming) {
-    setHeader("Transfer-Encoding", "chunked");
+void HTTPResponse::appendHead(const char *data, size_t len) {
+  if (headOverflow.empty() && headLength + len <= sizeof(head)) {
+    memcpy(head + headLength, data, len);
   } else {
-    stringstream len;
-    len << body.size();
-    setHeader("Content-Length", len.str());
+    if (headOverflow.empty()) {
+      headOverflow.assign(head, headLength);
+    }
+    headOverflow.append(data, len);
   }
+  headLength += len;
+}
 
-  out << "HTTP/1.1 " << status << " " << statusToString() << "\r\n";
+void HTTPResponse::appendHeader(const char *name, const char *value, size_t valueLength) {
+  appendHead(name, strlen(name));
+  appendHead(": ", 2);
+  appendHead(value, valueLength);
+  appendHead("\r\n", 2);
+}
+
+// The status line and headers go in head, or in headOverflow if they
+// don't fit, without building any strings along the way
+struct iovec HTTPResponse::formatHead() {
+  char number[32];
+  headLength = 0;
+  headOverflow.clear();
+
+  int len = snprintf(number, sizeof(number), "HTTP/1.1 %d ", status);
+  appendHead(number, len);
+  const char *reason = statusToString();
+  appendHead(reason, strlen(reason));
+  appendHead("\r\n", 2);
+
+  if (headers.find("Server") == headers.end()) {
+    appendHeader("Server", "Gunrock Web", strlen("Gunrock Web"));
+  }
+  appendHeader("Content-Type", contentType.data(), contentType.size());
+  if (streaming) {
+    appendHeader("Transfer-Encoding", "chunked", strlen("chunked"));
+  } else if (status != 304) {
+    // a 304 has no body, and its headers describe the one the client has
+    len = snprintf(number, sizeof(number), "%ld", source != NULL ? sourceLength : (long) body.size());
+    appendHeader("Content-Length", number, len);
+  }
   map<string, string>::iterator iter;
   for(iter = headers.begin(); iter != headers.end(); iter++) {
-    out << iter->first << ": " << iter->second << "\r\n";
+    appendHeader(iter->first.c_str(), iter->second.data(), iter->second.size());
   }
-  out << "\r\n";
-  if (body.size() > 0 && !streaming) {
-    out << body;
+  appendHead("\r\n", 2);
+
+  struct iovec iov;
+  iov.iov_base = headOverflow.empty() ? head : (void *) headOverflow.data();
+  iov.iov_len = headLength;
+  return iov;
+}
+
+bool HTTPResponse::hasInlineBody() {
+  return body.size() > 0 && !streaming && source == NULL;
+}
+
+string HTTPResponse::response() {
+  struct iovec iov = formatHead();
+  string out((const char *) iov.iov_base, iov.iov_len);
+  if (hasInlineBody()) {
+    out += body;
+  }
+  return out;
+}
+
+bool HTTPResponse::write(MySocket *client) {
+  struct iovec iov[2];
+  int count = 1;
+  iov[0] = formatHead();
+  if (hasInlineBody()) {
+    iov[1].iov_base = (void *) body.data();
+    iov[1].iov_len = body.size();
+    count = 2;
   }
+  // let the headers share a packet with the start of a body from a file
+  client->writev(iov, count, source != NULL && !streaming && sourceLength > 0);
+  return writeBody(client);
+}
+
+// Sends what the source has in files with sendfile and reads the rest,
+// a STREAM_BUFFER_SIZE piece at a time
+bool HTTPResponse::writeBody(MySocket *client) {
+  if (source == NULL) {
+    return true;
+  }
+
+  char buffer[STREAM_BUFFER_SIZE];
+  long written = 0;
+  while (true) {
+    if (!streaming && written < sourceLength) {
+      int fd;
+      off_t offset;
+      long bytes = source->nextExtent(&fd, &offset, sourceLength - written);
+      if (bytes == 0) {
+        return false;
+      }
+      if (bytes > 0) {
+        if (client->sendFile(fd, offset, bytes) != bytes) {
+          return false;
+        }
+        written += bytes;
+        continue;
+      }
+    }
 
-  return out.str();
+    int size = sizeof(buffer);
+    if (!streaming) {
+      size = (int) min((long) size, sourceLength - written);
+    }
+    int bytes = size > 0 ? source->read(buffer, size) : 0;
+    if (bytes < 0) {
+      return false;
+    }
+    if (bytes == 0) {
+      break;
+    }
+    if (streaming) {
+      HttpUtils::writeChunk(client, buffer, bytes);
+    } else {
+      struct iovec iov;
+      iov.iov_base = buffer;
+      iov.iov_len = bytes;
+      client->writev(&iov, 1);
+    }
+    written += bytes;
+  }
+
+  if (streaming) {
+    HttpUtils::writeLastChunk(client);
+    return true;
+  }
+  return written == sourceLength;
 }
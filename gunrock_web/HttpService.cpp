@@ -46,3 +46,6 @@ void HttpService::move(HTTPRequest *request, HTTPResponse *response) {
   throw ClientError::methodNotAllowed();
 }
 
+long HttpService::sizeHint(string path) {
+  return 0;
+}
@@ -1,7 +1,14 @@
 #include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
 
 #include "HttpUtils.h"
 
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
+
 using namespace std;
 
 map<string, string> HttpUtils::params(string query) {
@@ -43,6 +50,71 @@ void HttpUtils::writeLastChunk(MySocket *client) {
 }
 
 
+string HttpUtils::formatDate(time_t time) {
+  struct tm tm;
+  char buffer[64];
+  gmtime_r(&time, &tm);
+  strftime(buffer, sizeof(buffer), HTTP_DATE_FORMAT, &tm);
+  return buffer;
+}
+
+time_t HttpUtils::parseDate(const string &date) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(date.c_str(), HTTP_DATE_FORMAT, &tm);
+  if (end == NULL || *end != '\0') {
+    return -1;
+  }
+  return timegm(&tm);
+}
+
+// reads the digits at position, -1 if there are none
+static long parseNumber(const string &s, size_t *position) {
+  size_t start = *position;
+  long number = 0;
+  while (*position < s.size() && isdigit(s[*position]) && number < 0x7fffffffffffL / 10) {
+    number = number * 10 + (s[*position] - '0');
+    (*position)++;
+  }
+  return *position > start ? number : -1;
+}
+
+int HttpUtils::parseRange(const string &range, long length, long *first, long *last) {
+  const string prefix = "bytes=";
+  if (range.compare(0, prefix.size(), prefix) != 0) {
+    return -1;
+  }
+  size_t position = prefix.size();
+  long start = parseNumber(range, &position);
+  if (position >= range.size() || range[position] != '-') {
+    return -1;
+  }
+  position++;
+  long end = parseNumber(range, &position);
+  if (position != range.size() || (start < 0 && end < 0)) {
+    return -1;
+  }
+
+  if (start < 0) {
+    // the last end bytes
+    if (end == 0 || length == 0) {
+      return 0;
+    }
+    *first = max(0L, length - end);
+    *last = length - 1;
+    return 1;
+  }
+  if (end >= 0 && end < start) {
+    return -1;
+  }
+  if (start >= length) {
+    return 0;
+  }
+  *first = start;
+  *last = end < 0 ? length - 1 : min(end, length - 1);
+  return 1;
+}
+
 // split lifted from stackoverflow
 // http://stackoverflow.com/questions/236129/split-a-string-in-c
 vector<string> &HttpUtils::split(const string &s,
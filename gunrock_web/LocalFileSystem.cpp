@@ -6,6 +6,8 @@
 #include <cstring>
 #include <cmath>
 #include <algorithm>
+#include <time.h>
+#include <stdlib.h>
 
 #include "LocalFileSystem.h"
 #include "ufs.h"
@@ -13,19 +15,408 @@
 using namespace std;
 
 
-LocalFileSystem::LocalFileSystem(Disk *disk) {
+static void deleteOpenFiles(void *openFiles) {
+  delete (map<int, int> *) openFiles;
+}
+
+LocalFileSystem::LocalFileSystem(Disk *disk, int cacheBlocks) {
   this->disk = disk;
+  this->cache = new BufferCache(disk, cacheBlocks);
+  this->inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
+
+  char buffer[UFS_BLOCK_SIZE];
+  cache->readBlock(0, buffer);
+  memcpy(&superBlock, buffer, sizeof(super_t));
+  this->isReadOnly = superBlock.version < UFS_VERSION_INDIRECT;
+
+  inodeAllocator = new BitmapAllocator(cache, superBlock.inode_bitmap_addr,
+                                       superBlock.inode_bitmap_len, superBlock.num_inodes);
+  dataAllocator = new BitmapAllocator(cache, superBlock.data_bitmap_addr,
+                                      superBlock.data_bitmap_len, superBlock.num_data);
+
+  pthread_key_create(&transactionKey, NULL);
+  pthread_key_create(&openFilesKey, deleteOpenFiles);
+  pthread_mutex_init(&commitLock, NULL);
+  pthread_mutex_init(&inodeBlocksLock, NULL);
+  pthread_mutex_init(&dentriesLock, NULL);
+
+  // readers queue up behind a waiting commit instead of starving it
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  inodeOwners = new pthread_mutex_t[superBlock.num_inodes];
+  inodeLocks = new pthread_rwlock_t[superBlock.num_inodes];
+  for (int i = 0; i < superBlock.num_inodes; i++) {
+    pthread_mutex_init(&inodeOwners[i], NULL);
+    pthread_rwlock_init(&inodeLocks[i], &attr);
+  }
+  pthread_rwlockattr_destroy(&attr);
+}
+
+LocalFileSystem::~LocalFileSystem() {
+  for (map<int, inode_t *>::iterator it = inodeBlocks.begin(); it != inodeBlocks.end(); it++) {
+    delete [] it->second;
+  }
+  for (int i = 0; i < superBlock.num_inodes; i++) {
+    pthread_mutex_destroy(&inodeOwners[i]);
+    pthread_rwlock_destroy(&inodeLocks[i]);
+  }
+  delete [] inodeOwners;
+  delete [] inodeLocks;
+  pthread_mutex_destroy(&commitLock);
+  pthread_mutex_destroy(&inodeBlocksLock);
+  pthread_mutex_destroy(&dentriesLock);
+  pthread_key_delete(transactionKey);
+  pthread_key_delete(openFilesKey);
+  delete inodeAllocator;
+  delete dataAllocator;
+  delete cache;
+}
+
+/******************************* Transactions ******************************/
+
+// Runs a change made outside of a transaction in a transaction of its own
+class AutoTransaction {
+ public:
+  AutoTransaction(LocalFileSystem *fs) : fs(fs), isImplicit(!fs->isInTransaction()) {
+    if (isImplicit) {
+      fs->beginTransaction();
+    }
+  }
+  ~AutoTransaction() {
+    if (isImplicit) {
+      fs->commit();
+    }
+  }
+
+ private:
+  LocalFileSystem *fs;
+  bool isImplicit;
+};
+
+// Holds an inode's lock shared while it is in scope, see lockShared
+class LocalFileSystem::ReadGuard {
+ public:
+  ReadGuard(LocalFileSystem *fs, int inodeNumber) : lock(fs->lockShared(inodeNumber)) {}
+  ~ReadGuard() {
+    if (lock != NULL) {
+      pthread_rwlock_unlock(lock);
+    }
+  }
+
+ private:
+  pthread_rwlock_t *lock;
+};
+
+LocalFileSystem::Transaction *LocalFileSystem::currentTransaction() {
+  return (Transaction *) pthread_getspecific(transactionKey);
+}
+
+bool LocalFileSystem::isInTransaction() {
+  return currentTransaction() != NULL;
+}
+
+void LocalFileSystem::beginTransaction() {
+  if (currentTransaction() != NULL) {
+    cerr << "You can't start a new transaction: one already exists" << endl;
+    exit(1);
+  }
+  pthread_setspecific(transactionKey, new Transaction);
+}
+
+void LocalFileSystem::commit() {
+  Transaction *txn = currentTransaction();
+  if (txn == NULL) {
+    return;
+  }
+
+  // blocks the transaction freed don't belong to anything any more
+  map<unsigned int, unsigned char *> blocks;
+  blocks.swap(txn->blocks);
+  for (size_t i = 0; i < txn->dataChanges.released.size(); i++) {
+    map<unsigned int, unsigned char *>::iterator freed =
+      blocks.find(txn->dataChanges.released[i] + superBlock.data_region_addr);
+    if (freed != blocks.end()) {
+      delete [] freed->second;
+      blocks.erase(freed);
+    }
+  }
+
+  // readers of the inodes we own wait until all of the changes are in.
+  // Those readers can hold a file open for as long as a client takes to
+  // download it, so wait for them before taking commitLock: a commit
+  // stuck behind one only holds up readers of its own inodes, never
+  // other commits. No other transaction owns these inodes, so the order
+  // doesn't matter for deadlocks, but the set takes them lowest first.
+  set<int>::iterator owned;
+  for (owned = txn->owned.begin(); owned != txn->owned.end(); owned++) {
+    pthread_rwlock_wrlock(&inodeLocks[*owned]);
+  }
+  pthread_mutex_lock(&commitLock);
+
+  set<int> tableBlocks;
+  pthread_mutex_lock(&inodeBlocksLock);
+  for (map<int, inode_t>::iterator it = txn->inodes.begin(); it != txn->inodes.end(); it++) {
+    loadInodeBlock(it->first / inodesPerBlock)[it->first % inodesPerBlock] = it->second;
+    tableBlocks.insert(it->first / inodesPerBlock);
+  }
+  for (set<int>::iterator it = tableBlocks.begin(); it != tableBlocks.end(); it++) {
+    unsigned char *data = new unsigned char[UFS_BLOCK_SIZE];
+    memcpy(data, inodeBlocks[*it], UFS_BLOCK_SIZE);
+    blocks[superBlock.inode_region_addr + *it] = data;
+  }
+  pthread_mutex_unlock(&inodeBlocksLock);
+  vector<int> freedInodes = txn->inodeChanges.released;
+  vector<int> freedBlocks = txn->dataChanges.released;
+  inodeAllocator->commit(&txn->inodeChanges, &blocks);
+  dataAllocator->commit(&txn->dataChanges, &blocks);
+  long ticket = cache->commit(blocks);
+
+  pthread_mutex_lock(&dentriesLock);
+  for (size_t i = 0; i < txn->removedDirectories.size(); i++) {
+    forgetDirectory(txn->removedDirectories[i]);
+  }
+  map<pair<int, string>, int>::iterator dentry;
+  for (dentry = txn->dentries.begin(); dentry != txn->dentries.end(); dentry++) {
+    cacheDentry(dentry->first.first, dentry->first.second, dentry->second);
+  }
+  pthread_mutex_unlock(&dentriesLock);
+
+  pthread_mutex_unlock(&commitLock);
+  for (owned = txn->owned.begin(); owned != txn->owned.end(); owned++) {
+    pthread_rwlock_unlock(&inodeLocks[*owned]);
+  }
+
+  for (map<unsigned int, unsigned char *>::iterator it = blocks.begin(); it != blocks.end(); it++) {
+    delete [] it->second;
+  }
+  endTransaction(txn);
+
+  // the changes are visible already, other transactions can go ahead
+  // while this one waits for the disk. What it freed can only be reused
+  // after that, or a transaction could write a freed block home
+  // unjournaled and a crash would bring back the old file pointing at it.
+  disk->waitForCommit(ticket);
+  inodeAllocator->free(freedInodes);
+  dataAllocator->free(freedBlocks);
+}
+
+void LocalFileSystem::rollback() {
+  Transaction *txn = currentTransaction();
+  if (txn == NULL) {
+    return;
+  }
+  inodeAllocator->rollback(&txn->inodeChanges);
+  dataAllocator->rollback(&txn->dataChanges);
+  for (map<unsigned int, unsigned char *>::iterator it = txn->blocks.begin(); it != txn->blocks.end(); it++) {
+    delete [] it->second;
+  }
+  endTransaction(txn);
+}
+
+void LocalFileSystem::endTransaction(Transaction *txn) {
+  for (set<int>::iterator it = txn->owned.begin(); it != txn->owned.end(); it++) {
+    pthread_mutex_unlock(&inodeOwners[*it]);
+  }
+  delete txn;
+  pthread_setspecific(transactionKey, NULL);
+}
+
+// Makes the current transaction the owner of inodeNumber until it ends,
+// waiting for the transaction that owns it now
+void LocalFileSystem::ownInode(int inodeNumber) {
+  Transaction *txn = currentTransaction();
+  if (inodeNumber < 0 || inodeNumber >= superBlock.num_inodes || txn->owned.count(inodeNumber) > 0) {
+    return;
+  }
+  pthread_mutex_lock(&inodeOwners[inodeNumber]);
+  txn->owned.insert(inodeNumber);
+}
+
+// Locks inodeNumber shared and returns its lock, or NULL when there is
+// nothing to lock: the number is out of range, or the current
+// transaction owns the inode and nobody else can commit changes to it
+pthread_rwlock_t *LocalFileSystem::lockShared(int inodeNumber) {
+  if (inodeNumber < 0 || inodeNumber >= superBlock.num_inodes) {
+    return NULL;
+  }
+  Transaction *txn = currentTransaction();
+  if (txn != NULL && txn->owned.count(inodeNumber) > 0) {
+    return NULL;
+  }
+  // the thread has it open and locked already
+  map<int, int> *openFiles = (map<int, int> *) pthread_getspecific(openFilesKey);
+  if (openFiles != NULL && openFiles->count(inodeNumber) > 0) {
+    return NULL;
+  }
+  pthread_rwlock_rdlock(&inodeLocks[inodeNumber]);
+  return &inodeLocks[inodeNumber];
+}
+
+int LocalFileSystem::openFile(int inodeNumber) {
+  if (inodeNumber < 0 || inodeNumber >= superBlock.num_inodes) {
+    return -EINVALIDINODE;
+  }
+  map<int, int> *openFiles = (map<int, int> *) pthread_getspecific(openFilesKey);
+  if (openFiles == NULL) {
+    openFiles = new map<int, int>;
+    pthread_setspecific(openFilesKey, openFiles);
+  }
+  // a file the thread's transaction owns can't change under it anyway
+  map<int, int>::iterator open = openFiles->find(inodeNumber);
+  if (open != openFiles->end()) {
+    open->second++;
+  } else if (lockShared(inodeNumber) != NULL) {
+    (*openFiles)[inodeNumber] = 1;
+  }
+  return 0;
+}
+
+void LocalFileSystem::closeFile(int inodeNumber) {
+  map<int, int> *openFiles = (map<int, int> *) pthread_getspecific(openFilesKey);
+  if (openFiles == NULL) {
+    return;
+  }
+  map<int, int>::iterator open = openFiles->find(inodeNumber);
+  if (open != openFiles->end() && --open->second == 0) {
+    openFiles->erase(open);
+    pthread_rwlock_unlock(&inodeLocks[inodeNumber]);
+  }
+}
+
+void LocalFileSystem::readBlock(unsigned int blockNumber, void *buffer) {
+  Transaction *txn = currentTransaction();
+  if (txn != NULL) {
+    map<unsigned int, unsigned char *>::iterator written = txn->blocks.find(blockNumber);
+    if (written != txn->blocks.end()) {
+      memcpy(buffer, written->second, UFS_BLOCK_SIZE);
+      return;
+    }
+  }
+  cache->readBlock(blockNumber, buffer);
+}
+
+void LocalFileSystem::readBlocks(const unsigned int *blockNumbers, int numBlocks, void *buffer) {
+  cache->readBlocks(blockNumbers, numBlocks, buffer);
+  Transaction *txn = currentTransaction();
+  if (txn == NULL || txn->blocks.empty()) {
+    return;
+  }
+  for (int i = 0; i < numBlocks; i++) {
+    map<unsigned int, unsigned char *>::iterator written = txn->blocks.find(blockNumbers[i]);
+    if (written != txn->blocks.end()) {
+      memcpy((char *) buffer + i * UFS_BLOCK_SIZE, written->second, UFS_BLOCK_SIZE);
+    }
+  }
+}
+
+// only called from inside a transaction
+void LocalFileSystem::writeBlock(unsigned int blockNumber, const void *buffer) {
+  unsigned char *&data = currentTransaction()->blocks[blockNumber];
+  if (data == NULL) {
+    data = new unsigned char[UFS_BLOCK_SIZE];
+  }
+  memcpy(data, buffer, UFS_BLOCK_SIZE);
+}
+
+void LocalFileSystem::writeBlocks(const unsigned int *blockNumbers, int numBlocks, const void *buffer) {
+  for (int i = 0; i < numBlocks; i++) {
+    writeBlock(blockNumbers[i], (const char *) buffer + i * UFS_BLOCK_SIZE);
+  }
+}
+
+// File contents. Once the transaction holds TRANSACTION_BLOCKS blocks,
+// blocks it has allocated itself are written home instead, since nothing
+// committed points at them, so writing a large file doesn't keep all of
+// it in memory. Freed blocks are only allocated again once the commit
+// that freed them is durable, so nothing a crash brings back points at
+// them either. Blocks the transaction already holds stay with it.
+void LocalFileSystem::writeData(const unsigned int *blockNumbers, int numBlocks, const void *buffer) {
+  Transaction *txn = currentTransaction();
+  const char *src = (const char *) buffer;
+  int first = 0;
+  while (first < numBlocks) {
+    bool isHome = (int) txn->blocks.size() >= TRANSACTION_BLOCKS &&
+      txn->blocks.count(blockNumbers[first]) == 0 &&
+      !dataAllocator->isCommitted(blockNumbers[first] - superBlock.data_region_addr);
+    if (!isHome) {
+      writeBlock(blockNumbers[first], src + first * UFS_BLOCK_SIZE);
+      first++;
+      continue;
+    }
+    int count = 1;
+    while (first + count < numBlocks && txn->blocks.count(blockNumbers[first + count]) == 0 &&
+           !dataAllocator->isCommitted(blockNumbers[first + count] - superBlock.data_region_addr)) {
+      count++;
+    }
+    cache->writeUnjournaled(blockNumbers + first, count, src + first * UFS_BLOCK_SIZE);
+    first += count;
+  }
 }
 
 void LocalFileSystem::readSuperBlock(super_t *super) //done
 {
-  char buffer[UFS_BLOCK_SIZE];
-  disk->readBlock(0, buffer);
-  memcpy(super, buffer, sizeof(super_t));
+  *super = superBlock;
+}
+
+// callers hold inodeBlocksLock
+inode_t *LocalFileSystem::loadInodeBlock(int block) {
+  map<int, inode_t *>::iterator it = inodeBlocks.find(block);
+  if (it != inodeBlocks.end()) {
+    return it->second;
+  }
+
+  inode_t *inodes = new inode_t[inodesPerBlock];
+  cache->readBlock(superBlock.inode_region_addr + block, inodes);
+  inodeBlocks[block] = inodes;
+  return inodes;
+}
+
+void LocalFileSystem::readInode(int inodeNumber, inode_t *inode) {
+  Transaction *txn = currentTransaction();
+  if (txn != NULL) {
+    map<int, inode_t>::iterator written = txn->inodes.find(inodeNumber);
+    if (written != txn->inodes.end()) {
+      *inode = written->second;
+      return;
+    }
+  }
+  pthread_mutex_lock(&inodeBlocksLock);
+  inode_t *inodes = loadInodeBlock(inodeNumber / inodesPerBlock);
+  *inode = inodes[inodeNumber % inodesPerBlock];
+  pthread_mutex_unlock(&inodeBlocksLock);
+}
+
+void LocalFileSystem::writeInode(int inodeNumber, const inode_t *inode) {
+  AutoTransaction implicit(this);
+  currentTransaction()->inodes[inodeNumber] = *inode;
 }
 
 int LocalFileSystem::lookup(int parentInodeNumber, string name) //done
 {
+    //a transaction that owns the directory sees its own changes first,
+    //anyone else reads it with it locked so a commit can't change it
+    //between reading and caching the answer
+    Transaction *txn = currentTransaction();
+    bool isOwned = txn != NULL && txn->owned.count(parentInodeNumber) > 0;
+    ReadGuard guard(this, parentInodeNumber);
+    pair<int, string> key = make_pair(parentInodeNumber, name);
+    if (isOwned && txn->dentries.count(key) > 0) 
+    {
+        return txn->dentries[key];
+    }
+
+    //a cached result means parentInodeNumber was a directory
+    pthread_mutex_lock(&dentriesLock);
+    map<pair<int, string>, int>::iterator cached = dentries.find(key);
+    bool isCached = cached != dentries.end();
+    int cachedInodeNumber = isCached ? cached->second : 0;
+    pthread_mutex_unlock(&dentriesLock);
+    if (isCached) 
+    {
+        return cachedInodeNumber;
+    }
+
     inode_t inode;
     int returnStatus = stat(parentInodeNumber, &inode);
 
@@ -35,105 +426,144 @@ int LocalFileSystem::lookup(int parentInodeNumber, string name) //done
         return -EINVALIDINODE;
     }
 
-    //calculating the number of blocks occupied by the directory entries 
-    int blocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
-    int bytesLeft = inode.size;
-    int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
-
-    dir_ent_t dir_ent;
-
-    for (int i = 0; i < blocks; ++i) 
+    int inodeNumber = findEntry(&inode, name, NULL, NULL);
+    if (isOwned) 
+    {
+        txn->dentries[key] = inodeNumber;
+    } 
+    else 
     {
-        char buffer[UFS_BLOCK_SIZE];
-        disk->readBlock(inode.direct[i], buffer);
+        pthread_mutex_lock(&dentriesLock);
+        cacheDentry(parentInodeNumber, name, inodeNumber);
+        pthread_mutex_unlock(&dentriesLock);
+    }
+    return inodeNumber;
+}
 
-        // # of directories in current block
-        int entries = bytesLeft / sizeof(dir_ent_t);
-        if (entries > entriesPerBlock) 
-        {
-            entries = entriesPerBlock;
-        }
+// callers hold dentriesLock
+void LocalFileSystem::cacheDentry(int parentInodeNumber, const string &name, int inodeNumber) {
+  if (dentries.size() >= DENTRY_CACHE_SIZE) {
+    dentries.clear();
+  }
+  dentries[make_pair(parentInodeNumber, name)] = inodeNumber;
+}
 
-        // checking over each directory
-        for (int j = 0; j < entries; ++j) 
-        {
-            memcpy(&dir_ent, buffer + j * sizeof(dir_ent_t), sizeof(dir_ent_t));
-            // matching
-            if (name == dir_ent.name) 
-            {
-                return dir_ent.inum;
-            }
-        }
+// Drops the cached entries of a directory that is going away, so they
+// don't outlive its inode number being reused
+void LocalFileSystem::forgetDirectory(int inodeNumber) {
+  dentries.erase(dentries.lower_bound(make_pair(inodeNumber, string())),
+                 dentries.lower_bound(make_pair(inodeNumber + 1, string())));
+}
 
-        // reduction to one block
-        bytesLeft -= UFS_BLOCK_SIZE;
-    }
-    return -ENOTFOUND;
+int LocalFileSystem::cachedLookup(int parentInodeNumber, string name)
+{
+    pthread_mutex_lock(&dentriesLock);
+    map<pair<int, string>, int>::iterator cached = dentries.find(make_pair(parentInodeNumber, name));
+    int inodeNumber = cached != dentries.end() ? cached->second : -ENOTFOUND;
+    pthread_mutex_unlock(&dentriesLock);
+    return inodeNumber < 0 ? -ENOTFOUND : inodeNumber;
 }
 
 int LocalFileSystem::stat(int inodeNumber, inode_t *inode) //done
 {
-  //creating and reading the super block from disk
-  super_t super;
-  readSuperBlock(&super);
-
   //catch if it is in valid range
-  if (inodeNumber < 0 || inodeNumber > super.num_inodes - 1) 
+  if (inodeNumber < 0 || inodeNumber > superBlock.num_inodes - 1) 
   {
     return -EINVALIDINODE;
   }
 
-  //array to hold the list of nodes
-  inode_t inodeList[super.num_inodes];
-  readInodeRegion(&super, inodeList);
-
-  //copy data to the pointer
-  memcpy(inode, inodeList + inodeNumber, sizeof(inode_t));
+  //only the block holding this inode is read
+  readInode(inodeNumber, inode);
 
   return 0;
 }
 
 int LocalFileSystem::read(int inodeNumber, void *buffer, int size) //done
-  {
+{
+  //whole file reads are just reads from offset 0
+  return readAt(inodeNumber, buffer, size, 0);
+}
 
+int LocalFileSystem::readAt(int inodeNumber, void *buffer, int size, int offset)
+{
+  ReadGuard guard(this, inodeNumber);
   inode_t inode;
-  int returnStatus = stat(inodeNumber, &inode);
-
-  //valid check
-  if (returnStatus == -EINVALIDINODE) 
+  if (stat(inodeNumber, &inode) != 0) 
   {
     return -EINVALIDINODE;
   }
 
-  //valid check
-  if (size > MAX_FILE_SIZE || size < 0) {
+  if (size > maxFileSize() || size < 0 || offset < 0) {
     return -EINVALIDSIZE;
   }
 
-  //read based on the requested size
-  int blocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  //nothing past the end of the file
+  if (offset >= inode.size) 
+  {
+    return 0;
+  }
+  size = min(size, inode.size - offset);
+
+  char *dst = (char *) buffer;
+  int position = offset;
+  int end = offset + size;
+  char block[UFS_BLOCK_SIZE];
+
+  //partial first block
+  if (position % UFS_BLOCK_SIZE != 0) 
+  {
+    int bytes = min(end, (position / UFS_BLOCK_SIZE + 1) * UFS_BLOCK_SIZE) - position;
+    readBlock(fileBlock(&inode, position / UFS_BLOCK_SIZE), block);
+    memcpy(dst, block + position % UFS_BLOCK_SIZE, bytes);
+    position += bytes;
+  }
 
-  char bufferTemp[UFS_BLOCK_SIZE * blocks];
+  //whole blocks go straight into the caller's buffer, adjacent ones together
+  int wholeBlocks = (end - position) / UFS_BLOCK_SIZE;
+  if (wholeBlocks > 0) 
+  {
+    std::vector<unsigned int> blocks(wholeBlocks);
+    mapFileBlocks(&inode, position / UFS_BLOCK_SIZE, wholeBlocks, blocks.data());
+    readBlocks(blocks.data(), wholeBlocks, dst + (position - offset));
+    position += wholeBlocks * UFS_BLOCK_SIZE;
+  }
 
-  for (int i = 0; i < blocks; i++) {
-    disk->readBlock(inode.direct[i], bufferTemp + i * UFS_BLOCK_SIZE);
+  //partial last block
+  if (position < end) 
+  {
+    readBlock(fileBlock(&inode, position / UFS_BLOCK_SIZE), block);
+    memcpy(dst + (position - offset), block, end - position);
   }
 
-  memcpy(buffer, bufferTemp, size);
-  
   //return # of bytes read
   return size;
 }
 
 int LocalFileSystem::create(int parentInodeNumber, int type, string name) //done
 {
+    if (isReadOnly) 
+    {
+        return -EREADONLY;
+    }
+
     //validating name
     if (name.empty() || name.length() > DIR_ENT_NAME_SIZE) {
         return -EINVALIDNAME;
     }
 
-    //check if it exists
+    AutoTransaction implicit(this);
+    Transaction *txn = currentTransaction();
+
+    //check if it exists. Adding it needs the parent to be ours, and
+    //another transaction may have added it (or removed the parent) while
+    //we waited for that, so look again
     int existingInodeNumber = lookup(parentInodeNumber, name);
+    if (existingInodeNumber == -ENOTFOUND) 
+    {
+        ownInode(parentInodeNumber);
+        existingInodeNumber = inodeAllocator->isAllocated(parentInodeNumber) ?
+            lookup(parentInodeNumber, name) : -EINVALIDINODE;
+    }
     if (existingInodeNumber != -ENOTFOUND && existingInodeNumber != -EINVALIDINODE) 
     {
         inode_t existingInode;
@@ -168,89 +598,47 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) //done
         return -EINVALIDINODE;
     }
 
-    //check if theres enough space in the directory
+    //check if theres enough space for the new inode and a directory's block
     if ((type == UFS_REGULAR_FILE && !diskHasSpace(&super, 1, 0, 0)) ||
         (type == UFS_DIRECTORY && !diskHasSpace(&super, 1, 0, 1))) {
         return -ENOTENOUGHSPACE;
     }
 
-    //bitmapping to check if theres a free inode
-    std::vector<unsigned char> inodeBitmap(UFS_BLOCK_SIZE * super.inode_bitmap_len, 0);
-    readInodeBitmap(&super, inodeBitmap.data());
-
-    int freeInodeNumber = -1;
-    for (int byteIndex = 0; byteIndex < UFS_BLOCK_SIZE * super.inode_bitmap_len && freeInodeNumber == -1; ++byteIndex) 
+    //allocating a free inode, and placing a new directory near its parent
+    int freeInodeNumber = inodeAllocator->allocate(&txn->inodeChanges);
+    ownInode(freeInodeNumber);
+    int newBlockNumber = -1;
+    if (type == UFS_DIRECTORY) 
     {
-        for (int bitIndex = 0; bitIndex < 8; ++bitIndex) {
-            if ((inodeBitmap[byteIndex] & (1 << bitIndex)) == 0) 
-            {
-                freeInodeNumber = byteIndex * 8 + bitIndex;
-                inodeBitmap[byteIndex] |= (1 << bitIndex);
-                break;
-            }
-        }
+        newBlockNumber = dataAllocator->allocate(&txn->dataChanges, fileBlock(&parentInode, 0) - super.data_region_addr);
     }
 
-    //read parent inodes directory entries
-    std::vector<char> buffer(parentInode.size);
-    read(parentInodeNumber, buffer.data(), parentInode.size);
-
-    //creating new directory entries
-    int numDirEntries = parentInode.size / sizeof(dir_ent_t);
-    std::vector<dir_ent_t> dirEntries(numDirEntries + 1);
-
-    for (int i = 0; i < numDirEntries; ++i) {
-        memcpy(&dirEntries[i], buffer.data() + i * sizeof(dir_ent_t), sizeof(dir_ent_t));
-    }
-
-    //initializing the new directory entry
-    dir_ent_t newDirEntry;
-    newDirEntry.inum = freeInodeNumber;
-    memset(newDirEntry.name, 0, sizeof(newDirEntry.name));
-    memcpy(newDirEntry.name, name.c_str(), name.size());
-    dirEntries[numDirEntries] = newDirEntry;
-
-    //updating the parent inode size then write it back
-    parentInode.size += sizeof(dir_ent_t);
-    std::vector<inode_t> inodeList(super.num_inodes);
-    readInodeRegion(&super, inodeList.data());
-    inodeList[parentInodeNumber] = parentInode;
-
-    //write updated directory entries to parent inodes blocks
-    int blocksNeeded = (parentInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
-    std::vector<char> tempBuffer(UFS_BLOCK_SIZE * blocksNeeded, 0);
-    memcpy(tempBuffer.data(), dirEntries.data(), parentInode.size);
-
-    for (int i = 0; i < blocksNeeded; ++i) 
+    //adding the entry can grow the parent, give everything back if it can't
+    if (addEntry(&parentInode, name, freeInodeNumber) < 0) 
     {
-        disk->writeBlock(parentInode.direct[i], tempBuffer.data() + i * UFS_BLOCK_SIZE);
+        inodeAllocator->release(&txn->inodeChanges, freeInodeNumber);
+        if (newBlockNumber != -1) 
+        {
+            dataAllocator->release(&txn->dataChanges, newBlockNumber);
+        }
+        return -ENOTENOUGHSPACE;
     }
 
+    //updating the parent inode then write it back
+    touch(&parentInode);
+    writeInode(parentInodeNumber, &parentInode);
+    txn->dentries[make_pair(parentInodeNumber, name)] = freeInodeNumber;
+
     inode_t newInode;
+    memset(&newInode, 0, sizeof(inode_t));
     newInode.type = type;
+    touch(&newInode);
     if (type == UFS_REGULAR_FILE) 
     {
         newInode.size = 0;
     } else 
     {
         newInode.size = 2 * sizeof(dir_ent_t);
-
-        std::vector<unsigned char> dataBitmap(UFS_BLOCK_SIZE * super.data_bitmap_len, 0);
-        readDataBitmap(&super, dataBitmap.data());
-
-        int newBlockNumber = -1;
-        for (int byteIndex = 0; byteIndex < UFS_BLOCK_SIZE * super.data_bitmap_len && newBlockNumber == -1; ++byteIndex) {
-            for (int bitIndex = 0; bitIndex < 8; ++bitIndex) {
-                if ((dataBitmap[byteIndex] & (1 << bitIndex)) == 0) {
-                    dataBitmap[byteIndex] |= (1 << bitIndex);
-                    newBlockNumber = byteIndex * 8 + bitIndex;
-                    break;
-                }
-            }
-        }
-
-        if (newBlockNumber == -1) return -ENOTENOUGHSPACE;
-
         newInode.direct[0] = newBlockNumber + super.data_region_addr;
 
         // Create . and .. directory entries
@@ -267,20 +655,26 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) //done
         std::vector<char> initialBuffer(UFS_BLOCK_SIZE, 0);
         memcpy(initialBuffer.data(), initialEntries.data(), initialEntries.size() * sizeof(dir_ent_t));
 
-        disk->writeBlock(newInode.direct[0], initialBuffer.data());
-        writeDataBitmap(&super, dataBitmap.data());
+        writeBlock(newInode.direct[0], initialBuffer.data());
     }
 
-    //update inodelist and write to inode bitmap
-    inodeList[freeInodeNumber] = newInode;
-    writeInodeRegion(&super, inodeList.data());
-    writeInodeBitmap(&super, inodeBitmap.data());
+    //write the new inode
+    writeInode(freeInodeNumber, &newInode);
 
     return freeInodeNumber;
 }
 
 int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) //done
 {
+    if (isReadOnly) 
+    {
+        return -EREADONLY;
+    }
+
+    AutoTransaction implicit(this);
+    Transaction *txn = currentTransaction();
+    ownInode(inodeNumber);
+
     // retrieving for a given inode number
     inode_t inode;
     int returnStatus = stat(inodeNumber, &inode);
@@ -291,7 +685,13 @@ int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) //done
         return returnStatus;
     }
 
-    if (size > MAX_FILE_SIZE || size < 0) 
+    // it may have been unlinked since the caller looked it up
+    if (!inodeAllocator->isAllocated(inodeNumber)) 
+    {
+        return -ENOTALLOCATED;
+    }
+
+    if (size > maxFileSize() || size < 0) 
     {
         return -EINVALIDSIZE;
     }
@@ -312,89 +712,761 @@ int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) //done
         // in case more blocks are needed
         int extraBlocks = newBlocks - currentBlocks;
 
-        // check if there's enough space
-        if (!diskHasSpace(&super, 0, 0, extraBlocks)) 
+        // check if there's enough space, indirect blocks included
+        if (!diskHasSpace(&super, 0, 0, blocksToGrow(currentBlocks, newBlocks))) 
         {
             return -ENOTENOUGHSPACE;
         }
 
-        // allocate additional blocks
-        std::vector<int> newBlockNumbers;
-        std::vector<unsigned char> dataBitMap(UFS_BLOCK_SIZE * super.data_bitmap_len);
-        readDataBitmap(&super, dataBitMap.data());
-
-        for (int i = 0; i < UFS_BLOCK_SIZE * super.data_bitmap_len; i++) 
+        // keep the file in one run of blocks: extend it in place if the
+        // blocks after it are free, otherwise move the whole file to a
+        // free run since every block is rewritten below anyway. Its old
+        // blocks are only freed at commit, so that needs room for all of it.
+        int goal = currentBlocks > 0 ? fileBlock(&inode, currentBlocks - 1) - super.data_region_addr + 1 : -1;
+        bool fitsInPlace = currentBlocks > 0 && dataAllocator->nextAllocated(goal) >= goal + extraBlocks;
+        int run = -1;
+        if (!fitsInPlace && dataAllocator->reserve(&txn->dataChanges, currentBlocks)) 
+        {
+            run = dataAllocator->allocateRun(&txn->dataChanges, newBlocks, goal);
+            if (run < 0) 
+            {
+                // extendFile only needs what diskHasSpace reserved
+                dataAllocator->unreserve(&txn->dataChanges, currentBlocks);
+            }
+        }
+        if (run >= 0) 
         {
-            for (int j = 0; j < 8; j++) {
-                if ((dataBitMap[i] & (1 << j)) == 0) 
+            std::vector<unsigned int> blocks(newBlocks);
+            mapFileBlocks(&inode, 0, currentBlocks, blocks.data());
+            for (int i = 0; i < newBlocks; i++) 
+            {
+                if (i < currentBlocks) 
                 {
-                    dataBitMap[i] |= (1 << j);
-                    newBlockNumbers.push_back(i * 8 + j + super.data_region_addr);
-                    if (newBlockNumbers.size() == static_cast<std::vector<int>::size_type>(extraBlocks)) 
-                    {
-                        writeDataBitmap(&super, dataBitMap.data());
-                        break;
-                    }
+                    dataAllocator->release(&txn->dataChanges, blocks[i] - super.data_region_addr);
                 }
+                blocks[i] = run + i + super.data_region_addr;
             }
-            if (newBlockNumbers.size() == static_cast<std::vector<int>::size_type>(extraBlocks)) 
+            setFileBlocks(&inode, 0, newBlocks, blocks.data());
+        } 
+        else 
+        {
+            extendFile(&inode, currentBlocks, newBlocks);
+        }
+    } 
+    else if (newBlocks < currentBlocks) 
+    {
+        // freeing unused data blocks
+        truncateFileBlocks(&inode, currentBlocks, newBlocks);
+    }
+
+    // writing data, whole blocks straight from the caller's buffer
+    std::vector<unsigned int> blocks(newBlocks);
+    mapFileBlocks(&inode, 0, newBlocks, blocks.data());
+    int wholeBlocks = size / UFS_BLOCK_SIZE;
+    writeData(blocks.data(), wholeBlocks, buffer);
+    if (wholeBlocks < newBlocks) 
+    {
+        char block[UFS_BLOCK_SIZE];
+        memset(block, 0, sizeof(block));
+        memcpy(block, (const char *) buffer + wholeBlocks * UFS_BLOCK_SIZE, size % UFS_BLOCK_SIZE);
+        writeData(&blocks[wholeBlocks], 1, block);
+    }
+
+    // Update the inode size and table
+    inode.size = size;
+    touch(&inode);
+    writeInode(inodeNumber, &inode);
+
+    return size;
+}
+
+int LocalFileSystem::writeAt(int inodeNumber, const void *buffer, int size, int offset)
+{
+    if (isReadOnly) 
+    {
+        return -EREADONLY;
+    }
+
+    AutoTransaction implicit(this);
+    ownInode(inodeNumber);
+
+    inode_t inode;
+    if (stat(inodeNumber, &inode) != 0) 
+    {
+        return -EINVALIDINODE;
+    }
+
+    if (!inodeAllocator->isAllocated(inodeNumber)) 
+    {
+        return -ENOTALLOCATED;
+    }
+
+    if (size < 0 || offset < 0 || size > maxFileSize() || offset > maxFileSize() - size) 
+    {
+        return -EINVALIDSIZE;
+    }
+
+    if (inode.type != UFS_REGULAR_FILE) {
+        return -EINVALIDTYPE;
+    }
+
+    int end = offset + size;
+    if (size == 0 && offset <= inode.size) 
+    {
+        return 0;
+    }
+
+    int currentBlocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    int newBlocks = (max(end, inode.size) + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    if (newBlocks > currentBlocks) 
+    {
+        super_t super;
+        readSuperBlock(&super);
+        if (!diskHasSpace(&super, 0, 0, blocksToGrow(currentBlocks, newBlocks))) 
+        {
+            return -ENOTENOUGHSPACE;
+        }
+        extendFile(&inode, currentBlocks, newBlocks);
+    }
+
+    // writing past the end leaves a hole that reads back as zeros
+    if (offset > inode.size) 
+    {
+        writeSpan(&inode, currentBlocks, NULL, inode.size, offset - inode.size);
+    }
+    writeSpan(&inode, currentBlocks, (const char *) buffer, offset, size);
+
+    inode.size = max(inode.size, end);
+    touch(&inode);
+    writeInode(inodeNumber, &inode);
+
+    return size;
+}
+
+int LocalFileSystem::append(int inodeNumber, const void *buffer, int size)
+{
+    //the end of the file can't move once the inode is ours
+    AutoTransaction implicit(this);
+    ownInode(inodeNumber);
+    inode_t inode;
+    if (stat(inodeNumber, &inode) != 0) 
+    {
+        return -EINVALIDINODE;
+    }
+    return writeAt(inodeNumber, buffer, size, inode.size);
+}
+
+void LocalFileSystem::writeSpan(const inode_t *inode, int existingBlocks, const char *src, int offset, int size)
+{
+    // src is NULL to write zeros. Only partial blocks that already held
+    // data are read first.
+    int position = offset;
+    int end = offset + size;
+    char block[UFS_BLOCK_SIZE];
+
+    //partial first block, or the only block of a short span
+    if (position % UFS_BLOCK_SIZE != 0 || end - position < UFS_BLOCK_SIZE) 
+    {
+        int index = position / UFS_BLOCK_SIZE;
+        int bytes = min(end, (index + 1) * UFS_BLOCK_SIZE) - position;
+        unsigned int blockNumber = fileBlock(inode, index);
+        if (index < existingBlocks) 
+        {
+            readBlock(blockNumber, block);
+        } 
+        else 
+        {
+            memset(block, 0, sizeof(block));
+        }
+        if (src != NULL) 
+        {
+            memcpy(block + position % UFS_BLOCK_SIZE, src, bytes);
+        } 
+        else 
+        {
+            memset(block + position % UFS_BLOCK_SIZE, 0, bytes);
+        }
+        writeData(&blockNumber, 1, block);
+        position += bytes;
+    }
+
+    //whole blocks, adjacent ones together
+    int wholeBlocks = (end - position) / UFS_BLOCK_SIZE;
+    if (wholeBlocks > 0) 
+    {
+        std::vector<unsigned int> blocks(wholeBlocks);
+        mapFileBlocks(inode, position / UFS_BLOCK_SIZE, wholeBlocks, blocks.data());
+        if (src != NULL) 
+        {
+            writeData(blocks.data(), wholeBlocks, src + (position - offset));
+        } 
+        else 
+        {
+            int chunk = min(wholeBlocks, 64);
+            std::vector<char> zeros(chunk * UFS_BLOCK_SIZE, 0);
+            for (int i = 0; i < wholeBlocks; i += chunk) 
             {
-                break;
+                writeData(blocks.data() + i, min(chunk, wholeBlocks - i), zeros.data());
             }
         }
+        position += wholeBlocks * UFS_BLOCK_SIZE;
+    }
 
-        // updating new block numbers
-        for (size_t i = 0; i < newBlockNumbers.size(); i++) 
+    //partial last block
+    if (position < end) 
+    {
+        int index = position / UFS_BLOCK_SIZE;
+        unsigned int blockNumber = fileBlock(inode, index);
+        if (index < existingBlocks) 
+        {
+            readBlock(blockNumber, block);
+        } 
+        else 
+        {
+            memset(block, 0, sizeof(block));
+        }
+        if (src != NULL) 
+        {
+            memcpy(block, src + (position - offset), end - position);
+        } 
+        else 
         {
-            inode.direct[currentBlocks + i] = newBlockNumbers[i];
+            memset(block, 0, end - position);
         }
+        writeData(&blockNumber, 1, block);
+    }
+}
 
+void LocalFileSystem::extendFile(inode_t *inode, int currentBlocks, int newBlocks)
+{
+    // existing blocks keep their data, so instead of moving the file the
+    // new blocks go right after it if they can, else in one run of their own
+    BitmapChanges *changes = &currentTransaction()->dataChanges;
+    int extraBlocks = newBlocks - currentBlocks;
+    int last = currentBlocks > 0 ? fileBlock(inode, currentBlocks - 1) - superBlock.data_region_addr : -1;
+    int goal = last >= 0 ? last + 1 : -1;
+    int run = -1;
+    if (last >= 0 && dataAllocator->allocateRange(changes, goal, extraBlocks)) 
+    {
+        run = goal;
     } 
-    else if (newBlocks < currentBlocks) 
+    else 
     {
-        // freeing unused data blocks
-        std::vector<unsigned char> dataBitMap(UFS_BLOCK_SIZE * super.data_bitmap_len);
-        readDataBitmap(&super, dataBitMap.data());
-
-        for (int i = newBlocks; i < currentBlocks; i++) {
-            int blockNumber = inode.direct[i] - super.data_region_addr;
-            int byteIndex = blockNumber / 8;
-            int bitIndex = blockNumber % 8;
-            dataBitMap[byteIndex] &= ~(1 << bitIndex);
+        run = dataAllocator->allocateRun(changes, extraBlocks, goal);
+    }
+
+    std::vector<unsigned int> blocks(extraBlocks);
+    for (int i = 0; i < extraBlocks; i++) 
+    {
+        if (run >= 0) 
+        {
+            blocks[i] = run + i + superBlock.data_region_addr;
+        } 
+        else 
+        {
+            blocks[i] = dataAllocator->allocate(changes, goal) + superBlock.data_region_addr;
+            goal = blocks[i] - superBlock.data_region_addr + 1;
+        }
+    }
+    setFileBlocks(inode, currentBlocks, extraBlocks, blocks.data());
+}
+
+/******************************* Directories *******************************/
+
+// Small directories are a plain array of entries that lookup scans.
+// Inserts fill the first free slot, or go at the end, and unlinks free
+// the entry's slot in place, so either way one block is written. A
+// directory that would need a second block is rehashed into buckets of
+// one block each (see DIR_HASH_MAGIC in ufs.h), so a lookup, insert or
+// delete reads and writes a single block however big the directory is.
+// A full bucket doubles the number of buckets.
+
+// 32-bit FNV-1a
+static unsigned int hashName(const string &name) {
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < name.size(); i++) {
+    hash ^= (unsigned char) name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// names that fill the whole field have no terminating \0
+static string entryName(const dir_ent_t &entry) {
+  return string(entry.name, strnlen(entry.name, DIR_ENT_NAME_SIZE));
+}
+
+static dir_ent_t unusedEntry() {
+  dir_ent_t entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.inum = -1;
+  return entry;
+}
+
+bool LocalFileSystem::isHashedDirectory(const inode_t *dir) {
+  if (dir->size <= UFS_BLOCK_SIZE) {
+    return false;
+  }
+  dir_ent_t entries[DIR_ENTS_PER_BLOCK];
+  readBlock(fileBlock(dir, 0), entries);
+  return memcmp(entries[0].name + DIR_HASH_MAGIC_OFFSET, DIR_HASH_MAGIC, sizeof(DIR_HASH_MAGIC)) == 0;
+}
+
+void LocalFileSystem::listEntries(const inode_t *dir, std::vector<dir_ent_t> *entries) {
+  int blocks = (dir->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  std::vector<unsigned int> blockNumbers(blocks);
+  mapFileBlocks(dir, 0, blocks, blockNumbers.data());
+  std::vector<dir_ent_t> buffer(blocks * DIR_ENTS_PER_BLOCK);
+  readBlocks(blockNumbers.data(), blocks, buffer.data());
+
+  entries->clear();
+  int numEntries = dir->size / sizeof(dir_ent_t);
+  for (int i = 0; i < numEntries; i++) {
+    if (buffer[i].inum != -1) {
+      entries->push_back(buffer[i]);
+    }
+  }
+}
+
+int LocalFileSystem::readDirectory(int inodeNumber, std::vector<dir_ent_t> *entries) {
+  // locked so a commit can't publish the directory's new inode before
+  // the blocks it points at
+  ReadGuard guard(this, inodeNumber);
+  inode_t inode;
+  if (stat(inodeNumber, &inode) < 0 || inode.type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  }
+  listEntries(&inode, entries);
+  return 0;
+}
+
+int LocalFileSystem::findEntry(const inode_t *dir, const string &name, unsigned int *blockNumber, int *slot) {
+  int blocks = (dir->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  int first = 0;
+  int last = blocks;
+  if (isHashedDirectory(dir)) {
+    first = hashName(name) & (blocks - 1);
+    last = first + 1;
+  }
+
+  int entriesLeft = dir->size / sizeof(dir_ent_t) - first * DIR_ENTS_PER_BLOCK;
+  dir_ent_t entries[DIR_ENTS_PER_BLOCK];
+  for (int i = first; i < last; i++, entriesLeft -= DIR_ENTS_PER_BLOCK) {
+    unsigned int block = fileBlock(dir, i);
+    readBlock(block, entries);
+    int count = min(entriesLeft, DIR_ENTS_PER_BLOCK);
+    for (int j = 0; j < count; j++) {
+      if (entries[j].inum != -1 && entryName(entries[j]) == name) {
+        if (blockNumber != NULL) {
+          *blockNumber = block;
+          *slot = j;
         }
+        return entries[j].inum;
+      }
+    }
+  }
+  return -ENOTFOUND;
+}
 
-        writeDataBitmap(&super, dataBitMap.data());
+// Adds name to the directory, growing it if needed. The caller writes
+// the directory's inode back.
+int LocalFileSystem::addEntry(inode_t *dir, const string &name, int inodeNumber) {
+  dir_ent_t entry = unusedEntry();
+  entry.inum = inodeNumber;
+  memcpy(entry.name, name.c_str(), min((int) name.size(), DIR_ENT_NAME_SIZE));
+
+  int blocks = (dir->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  dir_ent_t entries[DIR_ENTS_PER_BLOCK];
+  std::vector<dir_ent_t> allEntries;
+
+  if (isHashedDirectory(dir)) {
+    int bucket = hashName(name) & (blocks - 1);
+    unsigned int block = fileBlock(dir, bucket);
+    readBlock(block, entries);
+    // "." and ".." always take the first two slots of bucket 0
+    for (int j = bucket == 0 ? 2 : 0; j < DIR_ENTS_PER_BLOCK; j++) {
+      if (entries[j].inum == -1) {
+        entries[j] = entry;
+        writeBlock(block, entries);
+        return 0;
+      }
     }
+    listEntries(dir, &allEntries);
+    allEntries.push_back(entry);
+    return rehashDirectory(dir, allEntries, blocks * 2);
+  }
 
-    // writing data
-    std::vector<char> tempBuffer(newBlocks * UFS_BLOCK_SIZE, 0);
-    memcpy(tempBuffer.data(), buffer, size);
+  // reuse a slot an unlink freed
+  int entriesLeft = dir->size / sizeof(dir_ent_t);
+  for (int i = 0; i < blocks; i++, entriesLeft -= DIR_ENTS_PER_BLOCK) {
+    unsigned int block = fileBlock(dir, i);
+    readBlock(block, entries);
+    int count = min(entriesLeft, DIR_ENTS_PER_BLOCK);
+    for (int j = 0; j < count; j++) {
+      if (entries[j].inum == -1) {
+        entries[j] = entry;
+        writeBlock(block, entries);
+        return 0;
+      }
+    }
+  }
 
-    for (int i = 0; i < newBlocks; i++) 
-    {
-        disk->writeBlock(inode.direct[i], tempBuffer.data() + i * UFS_BLOCK_SIZE);
+  if (dir->size % UFS_BLOCK_SIZE != 0) {
+    // there is room left in the last block
+    unsigned int block = fileBlock(dir, blocks - 1);
+    readBlock(block, entries);
+    entries[(dir->size % UFS_BLOCK_SIZE) / sizeof(dir_ent_t)] = entry;
+    writeBlock(block, entries);
+    dir->size += sizeof(dir_ent_t);
+    return 0;
+  }
+
+  listEntries(dir, &allEntries);
+  allEntries.push_back(entry);
+  return rehashDirectory(dir, allEntries, 2);
+}
+
+// Removes name from the directory. The caller writes the directory's
+// inode back.
+int LocalFileSystem::removeEntry(inode_t *dir, const string &name) {
+  unsigned int block;
+  int slot;
+  if (findEntry(dir, name, &block, &slot) < 0) {
+    return -EINVALIDNAME;
+  }
+
+  dir_ent_t entries[DIR_ENTS_PER_BLOCK];
+  readBlock(block, entries);
+  entries[slot] = unusedEntry();
+  writeBlock(block, entries);
+  if (isHashedDirectory(dir)) {
+    return 0;
+  }
+
+  // a linear directory gives back the free slots at its end, and its
+  // last blocks if they empty
+  int oldBlocks = (dir->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  int numEntries = dir->size / sizeof(dir_ent_t);
+  for (int i = oldBlocks - 1; i >= 0 && numEntries > 2; i--) {
+    readBlock(fileBlock(dir, i), entries);
+    while (numEntries > i * DIR_ENTS_PER_BLOCK && numEntries > 2 &&
+           entries[numEntries - 1 - i * DIR_ENTS_PER_BLOCK].inum == -1) {
+      numEntries--;
     }
+    if (numEntries > i * DIR_ENTS_PER_BLOCK) {
+      break;
+    }
+  }
+  dir->size = numEntries * sizeof(dir_ent_t);
+  truncateFileBlocks(dir, oldBlocks, (dir->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE);
+  return 0;
+}
 
-    // Update the inode size and table
-    inode.size = size;
-    std::vector<inode_t> inodeList(super.num_inodes);
-    readInodeRegion(&super, inodeList.data());
-    inodeList[inodeNumber] = inode;
-    writeInodeRegion(&super, inodeList.data());
+// Rewrites the directory as at least numBuckets hashed buckets holding
+// entries, "." and ".." first. The number of buckets keeps doubling
+// until no bucket overflows.
+int LocalFileSystem::rehashDirectory(inode_t *dir, const std::vector<dir_ent_t> &entries, int numBuckets) {
+  int maxBuckets = maxFileSize() / UFS_BLOCK_SIZE;
+  std::vector<dir_ent_t> buckets;
+  for (;; numBuckets *= 2) {
+    if (numBuckets > maxBuckets) {
+      return -ENOTENOUGHSPACE;
+    }
+    buckets.assign(numBuckets * DIR_ENTS_PER_BLOCK, unusedEntry());
+    std::vector<int> used(numBuckets, 0);
+    buckets[0] = entries[0];
+    memcpy(buckets[0].name + DIR_HASH_MAGIC_OFFSET, DIR_HASH_MAGIC, sizeof(DIR_HASH_MAGIC));
+    buckets[1] = entries[1];
+    used[0] = 2;
+
+    bool fits = true;
+    for (size_t i = 2; i < entries.size() && fits; i++) {
+      int bucket = hashName(entryName(entries[i])) & (numBuckets - 1);
+      if (used[bucket] == DIR_ENTS_PER_BLOCK) {
+        fits = false;
+      } else {
+        buckets[bucket * DIR_ENTS_PER_BLOCK + used[bucket]++] = entries[i];
+      }
+    }
+    if (fits) {
+      break;
+    }
+  }
 
-    return size;
+  int currentBlocks = (dir->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  if (numBuckets > currentBlocks) {
+    if (!diskHasSpace(&superBlock, 0, 0, blocksToGrow(currentBlocks, numBuckets))) {
+      return -ENOTENOUGHSPACE;
+    }
+    extendFile(dir, currentBlocks, numBuckets);
+  } else {
+    truncateFileBlocks(dir, currentBlocks, numBuckets);
+  }
+  dir->size = numBuckets * UFS_BLOCK_SIZE;
+
+  std::vector<unsigned int> blockNumbers(numBuckets);
+  mapFileBlocks(dir, 0, numBuckets, blockNumbers.data());
+  writeBlocks(blockNumbers.data(), numBuckets, buckets.data());
+  return 0;
+}
+
+/******************************* Block maps ********************************/
+
+// Block i of a file is direct[i] for the first NUM_DIRECT_BLOCKS blocks
+// (every block on version 0 images), then entry i - NUM_DIRECT_BLOCKS of
+// the indirect block, then it goes through the double indirect block.
+
+static bool isUnallocated(unsigned int pointer) {
+  return pointer == 0 || pointer == (unsigned int) -1;
+}
+
+int LocalFileSystem::maxFileSize() {
+  return superBlock.version >= UFS_VERSION_INDIRECT ? MAX_INDIRECT_FILE_SIZE : MAX_FILE_SIZE;
+}
+
+long LocalFileSystem::modificationTime(const inode_t *inode) {
+  // mkfs leaves unused pointers 0 or -1
+  if (superBlock.version < UFS_VERSION_INDIRECT || isUnallocated(inode->direct[MTIME_PTR])) {
+    return 0;
+  }
+  return inode->direct[MTIME_PTR];
+}
+
+void LocalFileSystem::touch(inode_t *inode) {
+  if (superBlock.version >= UFS_VERSION_INDIRECT) {
+    inode->direct[MTIME_PTR] = time(NULL);
+  }
+}
+
+int LocalFileSystem::pointerBlocksNeeded(int numBlocks) {
+  if (superBlock.version < UFS_VERSION_INDIRECT || numBlocks <= NUM_DIRECT_BLOCKS) {
+    return 0;
+  }
+  if (numBlocks <= NUM_DIRECT_BLOCKS + PTRS_PER_BLOCK) {
+    return 1;
+  }
+  // the indirect block, the double indirect block and its indirect blocks
+  int doubleBlocks = numBlocks - NUM_DIRECT_BLOCKS - PTRS_PER_BLOCK;
+  return 2 + (doubleBlocks + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+}
+
+int LocalFileSystem::blocksToGrow(int oldBlocks, int newBlocks) {
+  return newBlocks - oldBlocks + pointerBlocksNeeded(newBlocks) - pointerBlocksNeeded(oldBlocks);
+}
+
+unsigned int LocalFileSystem::fileBlock(const inode_t *inode, int index) {
+  unsigned int blockNumber;
+  mapFileBlocks(inode, index, 1, &blockNumber);
+  return blockNumber;
+}
+
+void LocalFileSystem::mapFileBlocks(const inode_t *inode, int first, int count, unsigned int *blocks) {
+  // consecutive file blocks share indirect blocks, so each is read once
+  unsigned int pointers[PTRS_PER_BLOCK];
+  unsigned int loaded = 0;
+  unsigned int tables[PTRS_PER_BLOCK];
+  bool tablesLoaded = false;
+
+  for (int i = 0; i < count; i++) {
+    int index = first + i;
+    if (superBlock.version < UFS_VERSION_INDIRECT || index < NUM_DIRECT_BLOCKS) {
+      blocks[i] = inode->direct[index];
+      continue;
+    }
+
+    index -= NUM_DIRECT_BLOCKS;
+    unsigned int table = inode->direct[INDIRECT_PTR];
+    if (index >= PTRS_PER_BLOCK) {
+      index -= PTRS_PER_BLOCK;
+      if (!tablesLoaded) {
+        readBlock(inode->direct[DOUBLE_INDIRECT_PTR], tables);
+        tablesLoaded = true;
+      }
+      table = tables[index / PTRS_PER_BLOCK];
+      index %= PTRS_PER_BLOCK;
+    }
+    if (table != loaded) {
+      readBlock(table, pointers);
+      loaded = table;
+    }
+    blocks[i] = pointers[index];
+  }
+}
+
+unsigned int LocalFileSystem::allocatePointerBlock(unsigned int nearBlock) {
+  // callers have already checked for space with blocksToGrow
+  return dataAllocator->allocate(&currentTransaction()->dataChanges, nearBlock - superBlock.data_region_addr) +
+    superBlock.data_region_addr;
+}
+
+void LocalFileSystem::setFileBlocks(inode_t *inode, int first, int count, const unsigned int *blocks) {
+  unsigned int pointers[PTRS_PER_BLOCK];
+  unsigned int loaded = 0;
+  bool dirty = false;
+  unsigned int tables[PTRS_PER_BLOCK];
+  bool tablesLoaded = false;
+  bool tablesDirty = false;
+
+  for (int i = 0; i < count; i++) {
+    int index = first + i;
+    if (index < NUM_DIRECT_BLOCKS) {
+      inode->direct[index] = blocks[i];
+      continue;
+    }
+
+    // find the slot that points at the indirect block for this index
+    index -= NUM_DIRECT_BLOCKS;
+    unsigned int *slot = &inode->direct[INDIRECT_PTR];
+    bool inTables = false;
+    if (index >= PTRS_PER_BLOCK) {
+      index -= PTRS_PER_BLOCK;
+      if (!tablesLoaded) {
+        if (isUnallocated(inode->direct[DOUBLE_INDIRECT_PTR])) {
+          inode->direct[DOUBLE_INDIRECT_PTR] = allocatePointerBlock(blocks[i]);
+          memset(tables, 0, sizeof(tables));
+          tablesDirty = true;
+        } else {
+          readBlock(inode->direct[DOUBLE_INDIRECT_PTR], tables);
+        }
+        tablesLoaded = true;
+      }
+      slot = &tables[index / PTRS_PER_BLOCK];
+      index %= PTRS_PER_BLOCK;
+      inTables = true;
+    }
+
+    if (isUnallocated(*slot) || *slot != loaded) {
+      if (dirty) {
+        writeBlock(loaded, pointers);
+        dirty = false;
+      }
+      if (isUnallocated(*slot)) {
+        *slot = allocatePointerBlock(blocks[i]);
+        tablesDirty |= inTables;
+        memset(pointers, 0, sizeof(pointers));
+        dirty = true;
+      } else {
+        readBlock(*slot, pointers);
+      }
+      loaded = *slot;
+    }
+    pointers[index] = blocks[i];
+    dirty = true;
+  }
+
+  if (dirty) {
+    writeBlock(loaded, pointers);
+  }
+  if (tablesDirty) {
+    writeBlock(inode->direct[DOUBLE_INDIRECT_PTR], tables);
+  }
+}
+
+void LocalFileSystem::truncateFileBlocks(inode_t *inode, int oldBlocks, int newBlocks) {
+  if (newBlocks >= oldBlocks) {
+    return;
+  }
+
+  // the blocks are only freed when the transaction commits
+  BitmapChanges *changes = &currentTransaction()->dataChanges;
+  std::vector<unsigned int> blocks(oldBlocks - newBlocks);
+  mapFileBlocks(inode, newBlocks, oldBlocks - newBlocks, blocks.data());
+  for (size_t i = 0; i < blocks.size(); i++) {
+    dataAllocator->release(changes, blocks[i] - superBlock.data_region_addr);
+  }
+
+  if (superBlock.version < UFS_VERSION_INDIRECT) {
+    return;
+  }
+
+  // then the indirect blocks that no longer map anything
+  int doubleStart = NUM_DIRECT_BLOCKS + PTRS_PER_BLOCK;
+  if (oldBlocks > doubleStart) {
+    unsigned int tables[PTRS_PER_BLOCK];
+    readBlock(inode->direct[DOUBLE_INDIRECT_PTR], tables);
+    int keep = newBlocks > doubleStart ? (newBlocks - doubleStart + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK : 0;
+    int used = (oldBlocks - doubleStart + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+    for (int k = keep; k < used; k++) {
+      dataAllocator->release(changes, tables[k] - superBlock.data_region_addr);
+      tables[k] = 0;
+    }
+    if (keep == 0) {
+      dataAllocator->release(changes, inode->direct[DOUBLE_INDIRECT_PTR] - superBlock.data_region_addr);
+      inode->direct[DOUBLE_INDIRECT_PTR] = 0;
+    } else {
+      writeBlock(inode->direct[DOUBLE_INDIRECT_PTR], tables);
+    }
+  }
+  if (oldBlocks > NUM_DIRECT_BLOCKS && newBlocks <= NUM_DIRECT_BLOCKS) {
+    dataAllocator->release(changes, inode->direct[INDIRECT_PTR] - superBlock.data_region_addr);
+    inode->direct[INDIRECT_PTR] = 0;
+  }
+}
+
+int LocalFileSystem::getFileBlocks(int inodeNumber, std::vector<unsigned int> *blocks) {
+  inode_t inode;
+  if (stat(inodeNumber, &inode) != 0) {
+    return -EINVALIDINODE;
+  }
+  blocks->resize((inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE);
+  mapFileBlocks(&inode, 0, blocks->size(), blocks->data());
+  return 0;
+}
+
+int LocalFileSystem::getFileExtent(int inodeNumber, int offset, int size, long *imageOffset) {
+  ReadGuard guard(this, inodeNumber);
+  inode_t inode;
+  if (stat(inodeNumber, &inode) != 0) {
+    return -EINVALIDINODE;
+  }
+  if (size < 0 || offset < 0) {
+    return -EINVALIDSIZE;
+  }
+  if (offset >= inode.size) {
+    return 0;
+  }
+  size = min(size, inode.size - offset);
+
+  // looking at a megabyte of the file at a time is plenty for one extent
+  int first = offset / UFS_BLOCK_SIZE;
+  int count = min((offset + size - 1) / UFS_BLOCK_SIZE - first + 1, 256);
+  std::vector<unsigned int> blocks(count);
+  mapFileBlocks(&inode, first, count, blocks.data());
+  int run = 1;
+  while (run < count && blocks[run] == blocks[0] + run) {
+    run++;
+  }
+  disk->waitUntilHome(blocks.data(), run);
+
+  *imageOffset = (long) blocks[0] * UFS_BLOCK_SIZE + offset % UFS_BLOCK_SIZE;
+  return min(size, run * UFS_BLOCK_SIZE - offset % UFS_BLOCK_SIZE);
 }
 
 int LocalFileSystem::unlink(int parentInodeNumber, string name) //done
 {
+    if (isReadOnly) 
+    {
+        return -EREADONLY;
+    }
+
     //prevent unlinking "." and ".."
     if (name == "." || name == "..") 
     {
         return -EUNLINKNOTALLOWED;
     }
 
-    //lookup child inode #
+    AutoTransaction implicit(this);
+    Transaction *txn = currentTransaction();
+
+    //lookup child inode #, then again once the parent is ours in case
+    //another transaction changed it while we waited
     int childInodeNumber = lookup(parentInodeNumber, name);
+    if (childInodeNumber >= 0) 
+    {
+        ownInode(parentInodeNumber);
+        childInodeNumber = inodeAllocator->isAllocated(parentInodeNumber) ?
+            lookup(parentInodeNumber, name) : -EINVALIDINODE;
+    }
     if (childInodeNumber == -EINVALIDINODE) 
     {
         return -EINVALIDINODE;
@@ -403,36 +1475,31 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) //done
     {
         return 0;
     }
-    //getting child inode
+    //getting child inode, which has to be ours too
+    ownInode(childInodeNumber);
     inode_t childInode;
     stat(childInodeNumber, &childInode);
 
-    //empty check
-    if (childInode.type == UFS_DIRECTORY && childInode.size > (int)(sizeof(dir_ent_t) * 2)) 
+    //empty check, hashed directories have free slots so count the entries
+    if (childInode.type == UFS_DIRECTORY) 
     {
-        return -EDIRNOTEMPTY;
+        std::vector<dir_ent_t> childEntries;
+        readDirectory(childInodeNumber, &childEntries);
+        if (childEntries.size() > 2) 
+        {
+            return -EDIRNOTEMPTY;
+        }
     }
 
     super_t super;
     readSuperBlock(&super);
     int numBlocks = (childInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
 
-    //deallocating block data
-    std::vector<unsigned char> dataBitmap(UFS_BLOCK_SIZE * super.data_bitmap_len, 0);
-    readDataBitmap(&super, dataBitmap.data());
-
-    for (int i = 0; i < numBlocks; ++i) 
-    {
-        int blockNum = childInode.direct[i] - super.data_region_addr;
-        dataBitmap[blockNum / 8] &= ~(1 << (blockNum % 8));
-    }
-    writeDataBitmap(&super, dataBitmap.data());
+    //deallocating block data, indirect blocks included
+    truncateFileBlocks(&childInode, numBlocks, 0);
 
     //inode deallocation
-    std::vector<unsigned char> inodeBitmap(UFS_BLOCK_SIZE * super.inode_bitmap_len, 0);
-    readInodeBitmap(&super, inodeBitmap.data());
-    inodeBitmap[childInodeNumber / 8] &= ~(1 << (childInodeNumber % 8));
-    writeInodeBitmap(&super, inodeBitmap.data());
+    inodeAllocator->release(&txn->inodeChanges, childInodeNumber);
 
     inode_t parentInode;
     if (stat(parentInodeNumber, &parentInode) < 0) 
@@ -440,47 +1507,15 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) //done
         return -EINVALIDINODE;
     }
 
-    // reading parent directory entries
-    std::vector<char> dirBuffer(parentInode.size, 0);
-    if (read(parentInodeNumber, dirBuffer.data(), parentInode.size) < 0) 
-    {
-        return -EINVALIDINODE;
-    }
-
-    //converting buffer to directory entries
-    int numEntries = parentInode.size / sizeof(dir_ent_t);
-    std::vector<dir_ent_t> dirEntries(numEntries);
-    memcpy(dirEntries.data(), dirBuffer.data(), parentInode.size);
-
-    //remove corresponding inode entry
-    auto it = std::remove_if(dirEntries.begin(), dirEntries.end(), [childInodeNumber](const dir_ent_t &entry) 
-    {
-        return entry.inum == childInodeNumber;
-    });
-
-    if (it == dirEntries.end()) 
+    //removing the entry from the parent
+    if (removeEntry(&parentInode, name) < 0) 
     {
         return -EINVALIDNAME;
     }
-
-    dirEntries.erase(it, dirEntries.end());
-
-    //updatign parent inode size and writing it back
-    parentInode.size -= sizeof(dir_ent_t);
-    std::vector<inode_t> inodeList(super.num_inodes);
-    readInodeRegion(&super, inodeList.data());
-    inodeList[parentInodeNumber] = parentInode;
-    writeInodeRegion(&super, inodeList.data());
-
-    //write back
-    std::vector<char> newDirBuffer(parentInode.size, 0);
-    memcpy(newDirBuffer.data(), dirEntries.data(), parentInode.size);
-
-    int newBlocks = (parentInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
-    for (int i = 0; i < newBlocks; ++i) 
-    {
-        disk->writeBlock(parentInode.direct[i], newDirBuffer.data() + i * UFS_BLOCK_SIZE);
-    }
+    touch(&parentInode);
+    writeInode(parentInodeNumber, &parentInode);
+    txn->dentries[make_pair(parentInodeNumber, name)] = -ENOTFOUND;
+    txn->removedDirectories.push_back(childInodeNumber);
 
     return 0;
 }
@@ -488,71 +1523,74 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) //done
 //my helper function defenitions
 void LocalFileSystem::readInodeBitmap(super_t *super, unsigned char *inodeBitmap) //done
 {
-  for (int i = 0; i < super->inode_bitmap_len; i++)
-  {
-    //temp buffer then read from the disk into the temp buffer
-    char buffer[UFS_BLOCK_SIZE];
-    disk->readBlock(super->inode_bitmap_addr + i, buffer);
-    //copying the contents into an inode bitmap array
-    memcpy(inodeBitmap + i * UFS_BLOCK_SIZE, buffer, sizeof(UFS_BLOCK_SIZE));
-  }
+  //the allocator holds the committed bitmap
+  inodeAllocator->read(inodeBitmap);
 }
 
 void LocalFileSystem::readDataBitmap(super_t *super, unsigned char *dataBitmap) //done
 {
-  //basically the same thing as inode bitmap
-  for (int i = 0; i < super->data_bitmap_len; i++) 
-  {
-    char buffer[UFS_BLOCK_SIZE];
-    disk->readBlock(super->data_bitmap_addr + i, buffer);
-    memcpy(dataBitmap + i * UFS_BLOCK_SIZE, buffer, sizeof(UFS_BLOCK_SIZE));
-  }
+  dataAllocator->read(dataBitmap);
 }
 
 void LocalFileSystem::readInodeRegion(super_t *super, inode_t *inodes) //done
-
 {
+  pthread_mutex_lock(&inodeBlocksLock);
+  for (int i = 0; i < super->num_inodes; i += inodesPerBlock)
+  {
+    //copy each cached block of the table into the inodes array
+    int count = min(inodesPerBlock, super->num_inodes - i);
+    memcpy(inodes + i, loadInodeBlock(i / inodesPerBlock), sizeof(inode_t) * count);
+  }
+  pthread_mutex_unlock(&inodeBlocksLock);
 
-  char buffer[UFS_BLOCK_SIZE * super->inode_region_len];
-  for (int i = 0; i < super->inode_region_len; i++) 
+  //then the ones the current transaction changed
+  Transaction *txn = currentTransaction();
+  if (txn != NULL)
   {
-    //reading the block from disk into corresponding position of the buffer
-    disk->readBlock(super->inode_region_addr + i, buffer + i * UFS_BLOCK_SIZE);
+    for (map<int, inode_t>::iterator it = txn->inodes.begin(); it != txn->inodes.end(); it++)
+    {
+      inodes[it->first] = it->second;
+    }
   }
-  // copy the contents of the buffer into the inodes array
-  memcpy(inodes, buffer, sizeof(inode_t) * super->num_inodes);
 }
 
-void LocalFileSystem::writeDataBitmap(super_t* super, unsigned char *dataBitmap) //done
+//bits that differ from the allocator's become allocations and releases
+//of the current transaction
+static void applyBitmap(BitmapAllocator *allocator, BitmapChanges *changes, const unsigned char *bitmap)
 {
-  for (int i = 0; i < super->data_bitmap_len; i++) 
+  for (int bit = 0; bit < allocator->numberOfBits(); bit++)
   {
-    //just reverse of read
-    char buffer[UFS_BLOCK_SIZE];
-    memcpy(buffer, dataBitmap + UFS_BLOCK_SIZE * i, UFS_BLOCK_SIZE);
-    disk->writeBlock(super->data_bitmap_addr + i, buffer);
+    bool isSet = (bitmap[bit / 8] >> (bit % 8)) & 1;
+    if (isSet && !allocator->isAllocated(bit) && allocator->reserve(changes, 1))
+    {
+      allocator->allocateRange(changes, bit, 1);
+    }
+    else if (!isSet && allocator->isAllocated(bit))
+    {
+      allocator->release(changes, bit);
+    }
   }
 }
 
+void LocalFileSystem::writeDataBitmap(super_t* super, unsigned char *dataBitmap) //done
+{
+  AutoTransaction implicit(this);
+  applyBitmap(dataAllocator, &currentTransaction()->dataChanges, dataBitmap);
+}
+
 void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes) //done
 {
-  for (int i = 0; i < super->inode_region_len; i++) 
+  AutoTransaction implicit(this);
+  for (int i = 0; i < super->num_inodes; i++)
   {
-    //same as previous write
-    char buffer[UFS_BLOCK_SIZE];
-    memcpy(buffer, inodes + UFS_BLOCK_SIZE * i, UFS_BLOCK_SIZE);
-    disk->writeBlock(super->inode_region_addr + i, buffer);
+    writeInode(i, &inodes[i]);
   }
 }
 
 void LocalFileSystem::writeInodeBitmap(super_t* super, unsigned char *inodeBitmap) //done
 {
-  for (int i = 0; i < super->inode_bitmap_len; i++) 
-  {
-    char buffer[UFS_BLOCK_SIZE];
-    memcpy(buffer, inodeBitmap + UFS_BLOCK_SIZE * i, UFS_BLOCK_SIZE);
-    disk->writeBlock(super->inode_bitmap_addr + i, buffer);
-  }
+  AutoTransaction implicit(this);
+  applyBitmap(inodeAllocator, &currentTransaction()->inodeChanges, inodeBitmap);
 }
 
 bool LocalFileSystem::diskHasSpace(super_t *super, int numInodesNeeded, int numDataBytesNeeded, int numDataBlocksNeeded) //done
@@ -560,44 +1598,16 @@ bool LocalFileSystem::diskHasSpace(super_t *super, int numInodesNeeded, int numD
     //calculating the total blocks required
     int requiredBlocks = (numDataBytesNeeded + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE + numDataBlocksNeeded;
 
-    //initializing and reading the data bitmap
-    std::vector<unsigned char> dataBitMap(UFS_BLOCK_SIZE * super->data_bitmap_len, 0);
-    readDataBitmap(super, dataBitMap.data());
-
-    // counting allocated data blocks
-    int allocatedBlocks = 0;
-    for (int i = 0; i < UFS_BLOCK_SIZE * super->data_bitmap_len; i++) 
-    {
-        for (int j = 0; j < 8; j++) {
-            if ((dataBitMap[i] & (1 << j)) != 0) 
-            {
-                allocatedBlocks++;
-            }
-        }
-    }
-
-    // Check if the required blocks are available
-    bool blockRequirement = (super->num_data - allocatedBlocks >= requiredBlocks);
-
-    // Initialize and read the inode bitmap
-    std::vector<unsigned char> inodeBitMap(UFS_BLOCK_SIZE * super->inode_bitmap_len, 0);
-    readInodeBitmap(super, inodeBitMap.data());
-
-    // Count the allocated inodes
-    int inodesAllocated = 0;
-    for (int i = 0; i < UFS_BLOCK_SIZE * super->inode_bitmap_len; i++) 
+    //the allocators keep live counts of what nobody has reserved
+    Transaction *txn = currentTransaction();
+    if (txn == NULL) 
     {
-        for (int j = 0; j < 8; j++) {
-            if ((inodeBitMap[i] & (1 << j)) != 0) 
-            {
-                inodesAllocated++;
-            }
-        }
+        return inodeAllocator->numberOfFree() >= numInodesNeeded &&
+            dataAllocator->numberOfFree() >= requiredBlocks;
     }
 
-    // Check if the required inodes are available
-    bool inodeRquirement = (super->num_inodes - inodesAllocated >= numInodesNeeded);
-
-    // Return true if both block and inode requirements are met, otherwise return false
-    return (inodeRquirement && blockRequirement);
-}
\ No newline at end of file
+    //if only the inodes can be had they stay reserved until the
+    //transaction ends, which is harmless
+    return inodeAllocator->reserve(&txn->inodeChanges, numInodesNeeded) &&
+        dataAllocator->reserve(&txn->dataChanges, requiredBlocks);
+}
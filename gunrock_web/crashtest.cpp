@@ -0,0 +1,181 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Disk.h"
+#include "LocalFileSystem.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Crashes a file system while the commit that deletes a file is on its
+// way to the disk, and checks that the file comes back intact.
+//
+// One transaction deletes "victim" and stops in the fdatasync that would
+// make the delete durable. Another then writes a file big enough to need
+// victim's blocks, past TRANSACTION_BLOCKS so the blocks would go
+// straight home. The crash keeps everything written to the image except
+// the journal blocks written since the last completed sync. Recovering
+// that image has to give back victim as it was: the delete never became
+// durable, so nothing else may have been written into its blocks.
+//
+// This program defines fdatasync, so Disk's calls come here. Images
+// must be made with a journal and must not be mapped.
+
+#define VICTIM_BLOCKS (96)
+
+// the journal as of the last completed fdatasync
+static int journalFd = -1;
+static off_t journalOffset;
+static vector<char> durableJournal;
+
+// fdatasync blocks while the gate is closed, after telling the test it
+// has been reached
+static pthread_mutex_t gateLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gateChanged = PTHREAD_COND_INITIALIZER;
+static bool gateClosed = false;
+static bool gateReached = false;
+
+extern "C" int fdatasync(int fd) {
+  pthread_mutex_lock(&gateLock);
+  if (gateClosed) {
+    gateReached = true;
+    pthread_cond_broadcast(&gateChanged);
+    while (gateClosed) {
+      pthread_cond_wait(&gateChanged, &gateLock);
+    }
+  }
+  pthread_mutex_unlock(&gateLock);
+
+  int ret = syscall(SYS_fdatasync, fd);
+  if (ret == 0 && fd == journalFd) {
+    if (pread(fd, durableJournal.data(), durableJournal.size(), journalOffset) != (ssize_t) durableJournal.size()) {
+      cerr << "Could not read the journal" << endl;
+      exit(1);
+    }
+  }
+  return ret;
+}
+
+static LocalFileSystem *fileSystem;
+
+static void *deleteVictim(void *) {
+  fileSystem->beginTransaction();
+  if (fileSystem->unlink(UFS_ROOT_DIRECTORY_INODE_NUMBER, "victim") != 0) {
+    cerr << "Could not delete victim" << endl;
+    exit(1);
+  }
+  fileSystem->commit();
+  return NULL;
+}
+
+// copies the image as it would be after a crash right now
+static void crashImage(const string &imageFile, const string &crashFile) {
+  int in = open(imageFile.c_str(), O_RDONLY);
+  int out = open(crashFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (in < 0 || out < 0) {
+    cerr << "Could not copy " << imageFile << endl;
+    exit(1);
+  }
+  char buffer[UFS_BLOCK_SIZE];
+  ssize_t bytes;
+  while ((bytes = read(in, buffer, sizeof(buffer))) > 0) {
+    if (write(out, buffer, bytes) != bytes) {
+      cerr << "Could not write " << crashFile << endl;
+      exit(1);
+    }
+  }
+  if (pwrite(out, durableJournal.data(), durableJournal.size(), journalOffset) !=
+      (ssize_t) durableJournal.size()) {
+    cerr << "Could not write " << crashFile << endl;
+    exit(1);
+  }
+  close(in);
+  close(out);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    cout << argv[0] << ": diskImageFile" << endl;
+    return 1;
+  }
+  string imageFile = argv[1];
+  string crashFile = imageFile + ".crash";
+
+  vector<char> victimData(VICTIM_BLOCKS * UFS_BLOCK_SIZE, 'v');
+  vector<char> reuseData(VICTIM_BLOCKS * UFS_BLOCK_SIZE, 'r');
+  bool reused;
+  {
+    Disk disk(imageFile, UFS_BLOCK_SIZE);
+    LocalFileSystem fs(&disk);
+    fileSystem = &fs;
+    super_t super;
+    fs.readSuperBlock(&super);
+    if (super.journal_len == 0) {
+      cerr << imageFile << " has no journal" << endl;
+      return 1;
+    }
+    journalFd = disk.fileDescriptor();
+    journalOffset = (off_t) super.journal_addr * UFS_BLOCK_SIZE;
+    durableJournal.resize((size_t) super.journal_len * UFS_BLOCK_SIZE);
+    fdatasync(journalFd);
+
+    fs.beginTransaction();
+    int victim = fs.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_REGULAR_FILE, "victim");
+    if (victim < 0 || fs.write(victim, victimData.data(), victimData.size()) != (int) victimData.size()) {
+      cerr << "Could not write victim" << endl;
+      return 1;
+    }
+    fs.commit();
+
+    // fill the disk so the only blocks left to reuse are victim's
+    int filler = fs.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_REGULAR_FILE, "filler");
+    char block[UFS_BLOCK_SIZE];
+    memset(block, 'f', sizeof(block));
+    while (fs.append(filler, block, sizeof(block)) == (int) sizeof(block)) {
+    }
+
+    pthread_mutex_lock(&gateLock);
+    gateClosed = true;
+    pthread_mutex_unlock(&gateLock);
+    pthread_t deleter;
+    pthread_create(&deleter, NULL, deleteVictim, NULL);
+    pthread_mutex_lock(&gateLock);
+    while (!gateReached) {
+      pthread_cond_wait(&gateChanged, &gateLock);
+    }
+    pthread_mutex_unlock(&gateLock);
+
+    fs.beginTransaction();
+    int reuse = fs.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_REGULAR_FILE, "reuse");
+    reused = reuse >= 0 && fs.write(reuse, reuseData.data(), reuseData.size()) == (int) reuseData.size();
+    crashImage(imageFile, crashFile);
+    fs.rollback();
+
+    pthread_mutex_lock(&gateLock);
+    gateClosed = false;
+    pthread_cond_broadcast(&gateChanged);
+    pthread_mutex_unlock(&gateLock);
+    pthread_join(deleter, NULL);
+  }
+  journalFd = -1;
+
+  Disk disk(crashFile, UFS_BLOCK_SIZE);
+  LocalFileSystem fs(&disk);
+  vector<char> recovered(victimData.size());
+  int victim = fs.lookup(UFS_ROOT_DIRECTORY_INODE_NUMBER, "victim");
+  bool intact = victim >= 0 && fs.read(victim, recovered.data(), recovered.size()) == (int) recovered.size() &&
+                recovered == victimData;
+  unlink(crashFile.c_str());
+
+  cout << "write while the delete was in flight " << (reused ? "reused its blocks" : "found no space")
+       << ", victim after the crash " << (intact ? "intact" : "corrupted") << endl;
+  return intact ? 0 : 1;
+}
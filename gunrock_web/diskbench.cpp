@@ -0,0 +1,164 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Compares block throughput of the Disk class against the original
+// per-block open/lseek/read-or-write/close access pattern. Reads time
+// readBlock on the pread/pwrite and the memory mapped backends and
+// batched readBlocks. Writes time writeBlock on both backends and one
+// journaled transaction of the same blocks on each. Writes put back
+// the data that was already in each block so the image is unchanged.
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void legacyReadBlock(string imageFile, int blockNumber, void *buffer) {
+  int fd = open(imageFile.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Could not open image file " << imageFile << endl;
+    exit(1);
+  }
+  lseek(fd, blockNumber * UFS_BLOCK_SIZE, SEEK_SET);
+  if (read(fd, buffer, UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE) {
+    cerr << "Could not read file" << endl;
+    exit(1);
+  }
+  close(fd);
+}
+
+static void legacyWriteBlock(string imageFile, int blockNumber, void *buffer) {
+  int fd = open(imageFile.c_str(), O_RDWR);
+  if (fd < 0) {
+    cerr << "Could not open image file " << imageFile << endl;
+    exit(1);
+  }
+  lseek(fd, blockNumber * UFS_BLOCK_SIZE, SEEK_SET);
+  if (write(fd, buffer, UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE) {
+    cerr << "Could not write file" << endl;
+    exit(1);
+  }
+  fsync(fd);
+  close(fd);
+}
+
+static void report(string name, long blocks, double seconds) {
+  cout << name << "\t" << blocks << " blocks in " << seconds << " s\t"
+       << (long) (blocks / seconds) << " blocks/sec" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 4) {
+    cout << argv[0] << ": diskImageFile [readPasses] [writeBlocks]" << endl;
+    return 1;
+  }
+
+  string imageFile = argv[1];
+  int readPasses = argc > 2 ? atoi(argv[2]) : 20;
+  int writeBlocks = argc > 3 ? atoi(argv[3]) : 256;
+
+  Disk disk(imageFile, UFS_BLOCK_SIZE);
+  Disk mappedDisk(DISK_MMAP_PREFIX + imageFile, UFS_BLOCK_SIZE);
+  int numBlocks = disk.numberOfBlocks();
+  if (writeBlocks > numBlocks) {
+    writeBlocks = numBlocks;
+  }
+  char buffer[UFS_BLOCK_SIZE];
+  double start;
+
+  start = now();
+  for (int pass = 0; pass < readPasses; pass++) {
+    for (int i = 0; i < numBlocks; i++) {
+      legacyReadBlock(imageFile, i, buffer);
+    }
+  }
+  report("read  open/lseek/read/close", (long) readPasses * numBlocks, now() - start);
+
+  start = now();
+  for (int pass = 0; pass < readPasses; pass++) {
+    for (int i = 0; i < numBlocks; i++) {
+      disk.readBlock(i, buffer);
+    }
+  }
+  report("read  Disk::readBlock       ", (long) readPasses * numBlocks, now() - start);
+
+  start = now();
+  for (int pass = 0; pass < readPasses; pass++) {
+    for (int i = 0; i < numBlocks; i++) {
+      mappedDisk.readBlock(i, buffer);
+    }
+  }
+  report("read  Disk::readBlock (mmap)", (long) readPasses * numBlocks, now() - start);
+
+  // a file's worth of adjacent blocks at a time
+  unsigned int blockNumbers[DIRECT_PTRS];
+  vector<char> fileBuffer(DIRECT_PTRS * UFS_BLOCK_SIZE);
+  start = now();
+  for (int pass = 0; pass < readPasses; pass++) {
+    for (int i = 0; i < numBlocks; i += DIRECT_PTRS) {
+      int count = min(DIRECT_PTRS, numBlocks - i);
+      for (int j = 0; j < count; j++) {
+        blockNumbers[j] = i + j;
+      }
+      disk.readBlocks(blockNumbers, count, fileBuffer.data());
+    }
+  }
+  report("read  Disk::readBlocks      ", (long) readPasses * numBlocks, now() - start);
+
+  start = now();
+  for (int i = 0; i < writeBlocks; i++) {
+    legacyReadBlock(imageFile, i, buffer);
+    legacyWriteBlock(imageFile, i, buffer);
+  }
+  report("write open/lseek/write/close", writeBlocks, now() - start);
+
+  start = now();
+  for (int i = 0; i < writeBlocks; i++) {
+    disk.readBlock(i, buffer);
+    disk.writeBlock(i, buffer);
+  }
+  report("write Disk::writeBlock      ", writeBlocks, now() - start);
+
+  start = now();
+  for (int i = 0; i < writeBlocks; i++) {
+    mappedDisk.readBlock(i, buffer);
+    mappedDisk.writeBlock(i, buffer);
+  }
+  report("write Disk::writeBlock (mmap)", writeBlocks, now() - start);
+
+  vector<char> transaction((size_t) writeBlocks * UFS_BLOCK_SIZE);
+  map<unsigned int, unsigned char *> blocks;
+  start = now();
+  for (int i = 0; i < writeBlocks; i++) {
+    disk.readBlock(i, &transaction[(size_t) i * UFS_BLOCK_SIZE]);
+    blocks[i] = (unsigned char *) &transaction[(size_t) i * UFS_BLOCK_SIZE];
+  }
+  disk.commit(blocks);
+  report("write Disk transaction      ", writeBlocks, now() - start);
+
+  blocks.clear();
+  start = now();
+  for (int i = 0; i < writeBlocks; i++) {
+    mappedDisk.readBlock(i, &transaction[(size_t) i * UFS_BLOCK_SIZE]);
+    blocks[i] = (unsigned char *) &transaction[(size_t) i * UFS_BLOCK_SIZE];
+  }
+  mappedDisk.commit(blocks);
+  report("write Disk transaction (mmap)", writeBlocks, now() - start);
+
+  return 0;
+}
@@ -2,20 +2,88 @@
 #include <string>
 #include <algorithm>
 #include <cstring>
+#include <vector>
 #include "LocalFileSystem.h"
 #include "Disk.h"
 #include "ufs.h"
 
 using namespace std;
 
+static bool isSet(unsigned char *bitmap, int bit)
+{
+    return (bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+// counts how many runs of adjacent blocks each file or directory is
+// split into, and how the free space of the data region is split up
+static void printFragmentation(LocalFileSystem &fs, super_t &super,
+                               unsigned char *inodeBitmap, unsigned char *dataBitmap)
+{
+    int files = 0, fragmentedFiles = 0, fileExtents = 0;
+    for (int i = 0; i < super.num_inodes; i++) 
+    {
+        inode_t inode;
+        if (!isSet(inodeBitmap, i) || fs.stat(i, &inode) != 0) 
+        {
+            continue;
+        }
+        vector<unsigned int> blocks;
+        fs.getFileBlocks(i, &blocks);
+        if (blocks.empty()) 
+        {
+            continue;
+        }
+        int extents = 1;
+        for (size_t j = 1; j < blocks.size(); j++) 
+        {
+            if (blocks[j] != blocks[j - 1] + 1) 
+            {
+                extents++;
+            }
+        }
+        files++;
+        fileExtents += extents;
+        if (extents > 1) 
+        {
+            fragmentedFiles++;
+        }
+    }
+
+    int freeBlocks = 0, freeExtents = 0, largestFreeExtent = 0, run = 0;
+    for (int i = 0; i <= super.num_data; i++) 
+    {
+        if (i < super.num_data && !isSet(dataBitmap, i)) 
+        {
+            freeBlocks++;
+            run++;
+            continue;
+        }
+        if (run > 0) 
+        {
+            freeExtents++;
+            largestFreeExtent = max(largestFreeExtent, run);
+        }
+        run = 0;
+    }
+
+    cout << "Fragmentation" << endl;
+    cout << "files " << files << endl;
+    cout << "fragmented_files " << fragmentedFiles << endl;
+    cout << "file_extents " << fileExtents << endl;
+    cout << "free_blocks " << freeBlocks << endl;
+    cout << "free_extents " << freeExtents << endl;
+    cout << "largest_free_extent " << largestFreeExtent << endl;
+}
+
 int main(int argc, char *argv[]) 
 {
-    if (argc != 2) {
-        cout << argv[0] << ": diskImageFile" << endl;
+    bool fragmentation = argc == 3 && string(argv[1]) == "-f";
+    if (argc != 2 && !fragmentation) {
+        cout << argv[0] << ": [-f] [mmap:]diskImageFile" << endl;
         return 1;
     }
 
-    Disk newDisk = Disk(argv[1], UFS_BLOCK_SIZE);
+    Disk newDisk = Disk(argv[argc - 1], UFS_BLOCK_SIZE);
     LocalFileSystem fs(&newDisk);
     super_t super;
     fs.readSuperBlock(&super);
@@ -49,6 +117,11 @@ int main(int argc, char *argv[])
         cout << (unsigned int)dataBitmap[i] << " ";
     }
     cout << endl;
+
+    if (fragmentation) {
+        cout << endl;
+        printFragmentation(fs, super, inodeBitmap, dataBitmap);
+    }
     
     return 0;
 }
\ No newline at end of file
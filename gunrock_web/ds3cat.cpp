@@ -2,6 +2,7 @@
 #include <string>
 #include <algorithm>
 #include <cstring>
+#include <vector>
 #include "LocalFileSystem.h"
 #include "Disk.h"
 #include "ufs.h"
@@ -11,7 +12,7 @@ using namespace std;
 int main(int argc, char *argv[]) 
 {
     if (argc != 3) {
-        cout << argv[0] << ": diskImageFile inodeNumber" << endl;
+        cout << argv[0] << ": [mmap:]diskImageFile inodeNumber" << endl;
         return 1;
     }
 
@@ -32,24 +33,29 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  //indirect blocks are followed on newer images
+  vector<unsigned int> blocks;
+  lfs.getFileBlocks(inodeNumber, &blocks);
+
   cout << "File blocks" << endl;
-  for (int i = 0; i < (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE; i++) 
+  for (size_t i = 0; i < blocks.size(); i++) 
   {
-    cout << inode.direct[i] << endl;
+    cout << blocks[i] << endl;
   }
   cout << endl;
 
   cout << "File data" << endl;
 
-  //creating the buffer to hold the file data
-  char buffer[inode.size];
+  //creating the buffer to hold the file data, on the heap since files
+  //can be large
+  vector<char> buffer(inode.size + 1);
   buffer[inode.size] = '\0';
 
   //read into the buffer and output it after
-  int out = lfs.read(inodeNumber, buffer, inode.size);
+  int out = lfs.read(inodeNumber, buffer.data(), inode.size);
   if (out == -EINVALIDINODE || out == -EINVALIDSIZE) {
     return 1;
   }
 
-  cout << buffer;
+  cout << buffer.data();
 }
\ No newline at end of file
@@ -23,20 +23,11 @@ void list(LocalFileSystem& localFileSystem, string directoryName, int inodeNumbe
     return;
   }
 
-  char buffer[inode.size];
-  localFileSystem.read(inodeNumber, buffer, inode.size);
-
-  // number of directory entry calculation
-  int numDirectoryEntries = inode.size / sizeof(dir_ent_t);
-  vector<dir_ent_t> directoryEntries(numDirectoryEntries);
+  vector<dir_ent_t> directoryEntries;
+  localFileSystem.readDirectory(inodeNumber, &directoryEntries);
 
   cout << "Directory " << directoryName << "\n";
 
-  // copy from vector to the buffer
-  for (int i = 0; i < numDirectoryEntries; i++) {
-    memcpy(&directoryEntries[i], buffer + (i * sizeof(dir_ent_t)), sizeof(dir_ent_t));
-  }
-
   sort(directoryEntries.begin(), directoryEntries.end(), compare_dir_ent_t);
 
   for (const auto& entry : directoryEntries) 
@@ -46,14 +37,14 @@ void list(LocalFileSystem& localFileSystem, string directoryName, int inodeNumbe
   cout << "\n";
 
   // skipping the . and ..
-  for (int i = 2; i < numDirectoryEntries; i++) {
+  for (size_t i = 2; i < directoryEntries.size(); i++) {
     list(localFileSystem, directoryName + directoryEntries[i].name + "/", directoryEntries[i].inum);
   }
 }
 
 int main(int argc, char *argv[]) {
   if (argc != 2) {
-    cout << argv[0] << ": diskImageFile" << endl;
+    cout << argv[0] << ": [mmap:]diskImageFile" << endl;
     return 1;
   }
 
@@ -3,6 +3,12 @@
 #include <assert.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <time.h>
 
 #include <iostream>
 #include <memory>
@@ -10,6 +16,7 @@
 #include <vector>
 #include <sstream>
 #include <deque>
+#include <set>
 
 #include "ClientError.h"
 #include "HTTPRequest.h"
@@ -30,13 +37,65 @@ string BASEDIR = "ds3";
 string SCHEDALG = "FIFO";
 string LOGFILE = "/dev/null";
 string DISKFILE = "disk.img";
+int CACHE_BLOCKS = DEFAULT_CACHE_BLOCKS;
+int KEEPALIVE_TIMEOUT = 5;
+int KEEPALIVE_REQUESTS = 100;
 
 vector<HttpService *> services;
 
-HttpService *find_service(HTTPRequest *request) {
+// Connections are read by one event loop, on non-blocking sockets, until
+// the headers of a request have arrived. They then wait here for a
+// worker, which runs the service and writes the response. At most
+// BUFFER_SIZE of them wait for workers, the event loop keeps any more in
+// its own backlog, in order, and hands them over as workers take them.
+// Workers take the oldest one (FIFO) or the one asking for the smallest
+// file (SFF).
+//
+// The service reads the body itself, straight from the socket, so it can
+// stream it (see HTTPRequest::readBody), and the worker throws away
+// whatever the service didn't read. Response bodies can be streamed the
+// same way (see HTTPResponse::setBodySource). Workers give up on a
+// client that stops sending or receiving a body for KEEPALIVE_TIMEOUT
+// seconds.
+//
+// Connections are kept alive unless the client asks otherwise. After the
+// response the worker hands the connection back to the event loop, along
+// with any bytes of pipelined requests it read past the end of this one.
+// The event loop closes connections that sit idle for KEEPALIVE_TIMEOUT
+// seconds, and a connection is closed after KEEPALIVE_REQUESTS requests.
+struct Connection {
+  MySocket *client;
+  HTTPRequest *request;
+  long size;
+  // bytes read past the end of the current request
+  string pending;
+  int numRequests;
+  time_t lastActive;
+};
+
+#define MAX_EVENTS (256)
+#define READ_SIZE (65536)
+
+deque<Connection *> connections;
+pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t connection_ready = PTHREAD_COND_INITIALIZER;
+
+// connections workers are done with, for the event loop to pick up when
+// wakeFd wakes it
+deque<Connection *> returned_connections;
+pthread_mutex_t returned_lock = PTHREAD_MUTEX_INITIALIZER;
+int epollFd = -1;
+int wakeFd = -1;
+
+// connections the event loop is waiting to read from, and ones with a
+// request that didn't fit in connections yet, only it uses these
+set<Connection *> waiting_connections;
+deque<Connection *> backlog;
+
+HttpService *find_service(string path) {
    // find a service that is registered for this path prefix
   for (unsigned int idx = 0; idx < services.size(); idx++) {
-    if (request->getPath().find(services[idx]->pathPrefix()) == 0) {
+    if (path.find(services[idx]->pathPrefix()) == 0) {
       return services[idx];
     }
   }
@@ -44,6 +103,10 @@ HttpService *find_service(HTTPRequest *request) {
   return NULL;
 }
 
+HttpService *find_service(HTTPRequest *request) {
+  return find_service(request->getPath());
+}
+
 
 void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPResponse *response) {
   stringstream payload;
@@ -78,48 +141,282 @@ void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPRespo
   }
 }
 
-void handle_request(MySocket *client) {
-  HTTPRequest *request = new HTTPRequest(client, PORT);
+void close_connection(Connection *connection) {
+  stringstream payload;
+  payload << " client: " << (void *) connection->client;
+  sync_print("close_connection", payload.str());
+  delete connection->request;
+  connection->client->close();
+  delete connection->client;
+  delete connection;
+}
+
+void wake_event_loop() {
+  uint64_t one = 1;
+  if (write(wakeFd, &one, sizeof(one)) < 0) {
+    perror("eventfd write");
+  }
+}
+
+void return_connection(Connection *connection) {
+  dthread_mutex_lock(&returned_lock);
+  returned_connections.push_back(connection);
+  dthread_mutex_unlock(&returned_lock);
+  wake_event_loop();
+}
+
+void handle_request(Connection *connection) {
+  MySocket *client = connection->client;
+  HTTPRequest *request = connection->request;
   HTTPResponse *response = new HTTPResponse();
   stringstream payload;
   
-  // read in the request
-  bool readResult = false;
-  try {
+  HttpService *service = find_service(request);
+  invoke_service_method(service, request, response);
+
+  // the rest of the body has to be read before the next request
+  bool isRead = request->isDone() || request->readBody(NULL);
+  connection->pending.append(request->takeLeftover());
+  if (!isRead) {
     payload << "client: " << (void *) client;
-    sync_print("read_request_enter", payload.str());
-    readResult = request->readRequest();
-    sync_print("read_request_return", payload.str());
-  } catch (...) {
-    // swallow it
-  }    
-    
-  if (!readResult) {
-    // there was a problem reading in the request, bail
-    delete response;
-    delete request;
     sync_print("read_request_error", payload.str());
+    delete response;
+    close_connection(connection);
     return;
   }
-  
-  HttpService *service = find_service(request);
-  invoke_service_method(service, request, response);
+
+  connection->numRequests++;
+  bool keepAlive = request->keepAlive() && connection->numRequests < KEEPALIVE_REQUESTS;
+  response->setHeader("Connection", keepAlive ? "keep-alive" : "close");
 
   // send data back to the client and clean up
-  payload.str(""); payload.clear();
   payload << " RESPONSE " << response->getStatus() << " client: " << (void *) client;
   sync_print("write_response", payload.str());
   cout << payload.str() << endl;
-  client->write(response->response());
+  try {
+    if (!response->write(client)) {
+      // the client has part of a body, nothing else can follow it
+      keepAlive = false;
+    }
+  } catch (...) {
+    // the client went away, nothing left to do but close
+    keepAlive = false;
+  }
     
   delete response;
-  delete request;
+  if (!keepAlive) {
+    close_connection(connection);
+    return;
+  }
 
-  payload.str(""); payload.clear();
-  payload << " client: " << (void *) client;
-  sync_print("close_connection", payload.str());
-  client->close();
-  delete client;
+  delete connection->request;
+  connection->request = new HTTPRequest(client, PORT);
+  return_connection(connection);
+}
+
+// Size of the file a request asks for, for the SFF scheduler
+long request_size(HTTPRequest *request) {
+  HttpService *service = find_service(request);
+  if (service == NULL || !request->isGet()) {
+    return 0;
+  }
+  return service->sizeHint(request->getPath());
+}
+
+// Moves backlogged connections to the workers while there is room
+void fill_connections() {
+  dthread_mutex_lock(&connections_lock);
+  while (!backlog.empty() && (int) connections.size() < BUFFER_SIZE) {
+    connections.push_back(backlog.front());
+    backlog.pop_front();
+    dthread_cond_signal(&connection_ready);
+  }
+  dthread_mutex_unlock(&connections_lock);
+}
+
+// The event loop never waits for a worker here, a full queue only grows
+// the backlog
+void enqueue_connection(Connection *connection) {
+  connection->size = SCHEDALG == "SFF" ? request_size(connection->request) : 0;
+  backlog.push_back(connection);
+  fill_connections();
+}
+
+Connection *dequeue_connection() {
+  dthread_mutex_lock(&connections_lock);
+  while (connections.empty()) {
+    dthread_cond_wait(&connection_ready, &connections_lock);
+  }
+  deque<Connection *>::iterator next = connections.begin();
+  if (SCHEDALG == "SFF") {
+    for (deque<Connection *>::iterator it = connections.begin(); it != connections.end(); it++) {
+      if ((*it)->size < (*next)->size) {
+        next = it;
+      }
+    }
+  }
+  Connection *connection = *next;
+  connections.erase(next);
+  // the event loop may be holding more in its backlog
+  bool wasFull = (int) connections.size() + 1 >= BUFFER_SIZE;
+  dthread_mutex_unlock(&connections_lock);
+  if (wasFull) {
+    wake_event_loop();
+  }
+  return connection;
+}
+
+void *worker(void *arg) {
+  while (true) {
+    handle_request(dequeue_connection());
+  }
+  return NULL;
+}
+
+void set_nonblocking(int fd, bool nonblocking) {
+  int flags = fcntl(fd, F_GETFL);
+  fcntl(fd, F_SETFL, nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+void stop_waiting(Connection *connection) {
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->client->getFd(), NULL);
+  waiting_connections.erase(connection);
+}
+
+void wait_for_data(Connection *connection) {
+  set_nonblocking(connection->client->getFd(), true);
+  connection->lastActive = time(NULL);
+
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = connection;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, connection->client->getFd(), &event);
+  waiting_connections.insert(connection);
+}
+
+// Parses bytes read for the connection's request, keeping whatever comes
+// after its end. Returns false if the connection has to be closed.
+bool parse_request(Connection *connection, const char *buffer, int len) {
+  int used = connection->request->addData(buffer, len);
+  if (used < 0) {
+    return false;
+  }
+  connection->pending.append(buffer + used, len - used);
+  return true;
+}
+
+void dispatch_request(Connection *connection) {
+  stringstream payload;
+  payload << "client: " << (void *) connection->client;
+  sync_print("read_request_return", payload.str());
+  set_nonblocking(connection->client->getFd(), false);
+  enqueue_connection(connection);
+}
+
+// The sockets are edge triggered, so accept and read until they would block
+void accept_connections(int serverFd) {
+  while (true) {
+    int clientFd = accept4(serverFd, NULL, NULL, SOCK_NONBLOCK);
+    if (clientFd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("accept");
+      }
+      if (errno != EINTR) {
+        return;
+      }
+      continue;
+    }
+    sync_print("client_accepted", "");
+
+    // workers read and write bodies with blocking calls, which time out
+    struct timeval timeout;
+    timeout.tv_sec = KEEPALIVE_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(clientFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    Connection *connection = new Connection;
+    connection->client = new MySocket(clientFd);
+    connection->request = new HTTPRequest(connection->client, PORT);
+    connection->size = 0;
+    connection->numRequests = 0;
+    wait_for_data(connection);
+  }
+}
+
+void read_connection(Connection *connection) {
+  char buffer[READ_SIZE];
+  int fd = connection->client->getFd();
+  stringstream payload;
+  payload << "client: " << (void *) connection->client;
+  connection->lastActive = time(NULL);
+
+  while (true) {
+    int ret = recv(fd, buffer, sizeof(buffer), 0);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // wait for the rest of the request
+      return;
+    }
+    if (ret <= 0 || !parse_request(connection, buffer, ret)) {
+      // the client went away or isn't speaking HTTP
+      sync_print("read_request_error", payload.str());
+      stop_waiting(connection);
+      close_connection(connection);
+      return;
+    }
+    if (connection->request->isHeaderDone()) {
+      stop_waiting(connection);
+      dispatch_request(connection);
+      return;
+    }
+  }
+}
+
+// Connections come back from the workers with a fresh request, which may
+// already have arrived if the client pipelined it. Workers also wake the
+// event loop when they make room for the backlog.
+void pick_up_returned_connections() {
+  uint64_t count;
+  if (read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    perror("eventfd read");
+  }
+
+  fill_connections();
+
+  dthread_mutex_lock(&returned_lock);
+  deque<Connection *> returned;
+  returned.swap(returned_connections);
+  dthread_mutex_unlock(&returned_lock);
+
+  for (size_t idx = 0; idx < returned.size(); idx++) {
+    Connection *connection = returned[idx];
+    string pending;
+    pending.swap(connection->pending);
+    if (!parse_request(connection, pending.data(), pending.size())) {
+      close_connection(connection);
+    } else if (connection->request->isHeaderDone()) {
+      dispatch_request(connection);
+    } else {
+      wait_for_data(connection);
+    }
+  }
+}
+
+void close_idle_connections() {
+  time_t now = time(NULL);
+  vector<Connection *> idle;
+  for (set<Connection *>::iterator it = waiting_connections.begin(); it != waiting_connections.end(); it++) {
+    if (now - (*it)->lastActive >= KEEPALIVE_TIMEOUT) {
+      idle.push_back(*it);
+    }
+  }
+  for (size_t idx = 0; idx < idle.size(); idx++) {
+    stop_waiting(idle[idx]);
+    close_connection(idle[idx]);
+  }
 }
 
 int main(int argc, char *argv[]) {
@@ -127,7 +424,7 @@ int main(int argc, char *argv[]) {
   signal(SIGPIPE, SIG_IGN);
   int option;
 
-  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:")) != -1) {
+  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:c:k:r:")) != -1) {
     switch (option) {
     case 'd':
       BASEDIR = string(optarg);
@@ -150,29 +447,76 @@ int main(int argc, char *argv[]) {
     case 'i':
       DISKFILE = string(optarg);
       break;
+    case 'c':
+      CACHE_BLOCKS = atoi(optarg);
+      break;
+    case 'k':
+      KEEPALIVE_TIMEOUT = atoi(optarg);
+      break;
+    case 'r':
+      KEEPALIVE_REQUESTS = atoi(optarg);
+      break;
     default:
-      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile]" << endl;
+      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-s FIFO|SFF] [-i [mmap:]diskFile] [-c cacheBlocks] [-k keepAliveSeconds] [-r requestsPerConnection]" << endl;
       exit(1);
     }
   }
 
+  if (THREAD_POOL_SIZE < 1 || BUFFER_SIZE < 1 || KEEPALIVE_TIMEOUT < 1 || KEEPALIVE_REQUESTS < 1 ||
+      (SCHEDALG != "FIFO" && SCHEDALG != "SFF")) {
+    cerr << "threads, buffers and keep-alive limits must be positive and the scheduler FIFO or SFF" << endl;
+    exit(1);
+  }
+
   set_log_file(LOGFILE);
 
   cout << "Lisening on port " << PORT << endl;
   
   sync_print("init", "");
   MyServerSocket *server = new MyServerSocket(PORT);
-  MySocket *client;
 
   // The order that you push services dictates the search order
   // for path prefix matching
-  services.push_back(new DistributedFileSystemService(DISKFILE));
+  services.push_back(new DistributedFileSystemService(DISKFILE, CACHE_BLOCKS));
   services.push_back(new FileService(BASEDIR));
-  
+
+  for (int idx = 0; idx < THREAD_POOL_SIZE; idx++) {
+    pthread_t thread;
+    dthread_create(&thread, NULL, worker, NULL);
+    dthread_detach(thread);
+  }
+
+  epollFd = epoll_create1(0);
+  wakeFd = eventfd(0, EFD_NONBLOCK);
+  if (epollFd < 0 || wakeFd < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  set_nonblocking(server->getFd(), true);
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = server;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, server->getFd(), &event);
+  event.data.ptr = &wakeFd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+
+  struct epoll_event events[MAX_EVENTS];
+  time_t lastSweep = time(NULL);
   while(true) {
     sync_print("waiting_to_accept", "");
-    client = server->accept();
-    sync_print("client_accepted", "");
-    handle_request(client);
+    int numEvents = epoll_wait(epollFd, events, MAX_EVENTS, 1000);
+    for (int idx = 0; idx < numEvents; idx++) {
+      if (events[idx].data.ptr == server) {
+        accept_connections(server->getFd());
+      } else if (events[idx].data.ptr == &wakeFd) {
+        pick_up_returned_connections();
+      } else {
+        read_connection((Connection *) events[idx].data.ptr);
+      }
+    }
+    if (time(NULL) != lastSweep) {
+      lastSweep = time(NULL);
+      close_idle_connections();
+    }
   }
 }
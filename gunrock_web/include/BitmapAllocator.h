@@ -0,0 +1,114 @@
+#ifndef _BITMAP_ALLOCATOR_H_
+#define _BITMAP_ALLOCATOR_H_
+
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "BufferCache.h"
+
+// The bits one transaction has taken from a bitmap and given back to
+// it, and how many bits it still has reserved
+struct BitmapChanges {
+  std::vector<int> allocated;
+  std::vector<int> released;
+  int reserved;
+
+  BitmapChanges() : reserved(0) {}
+};
+
+/**
+ * Allocates bits out of one of the on-disk bitmaps (inode or data).
+ *
+ * The bitmap is read from the cache once, at construction, and kept in
+ * memory as 64-bit words so a free bit can be found a word at a time.
+ * The allocator keeps a count of free bits and a hint where the next
+ * search starts, so neither allocating nor asking how much space is left
+ * has to look at the whole bitmap.
+ *
+ * Several transactions can allocate at once, each recording what it did
+ * in its own BitmapChanges. Allocated bits are taken straight away so no
+ * other transaction gets them. Released bits only become free once the
+ * commit that releases them is durable and the caller hands them to
+ * free(): until then a crash can bring back an inode that points at the
+ * blocks, so nobody may write anything else into them. A transaction reserves the bits it is going to need up front and
+ * allocations draw the reservation down, so a check for space can't be
+ * undone by another transaction allocating in between. A second copy of
+ * the words holds only committed changes, and that is what commit()
+ * hands back for the disk. Every method takes the allocator's lock for a
+ * short while.
+ */
+class BitmapAllocator {
+ public:
+  BitmapAllocator(BufferCache *cache, int bitmapAddr, int bitmapLen, int numBits);
+  ~BitmapAllocator();
+
+  // Sets count bits aside for changes, false if there are not that many
+  // that are neither allocated nor reserved
+  bool reserve(BitmapChanges *changes, int count);
+  // Gives back up to count bits of changes' reservation
+  void unreserve(BitmapChanges *changes, int count);
+
+  // The allocate methods only take bits that other transactions haven't
+  // reserved, so a reservation that succeeded can always be claimed.
+  // Returns the index of a newly allocated bit, or -1 if all are in use.
+  // The search starts at goal if it is given and at the hint otherwise.
+  int allocate(BitmapChanges *changes, int goal = -1);
+  // Allocates count adjacent bits and returns the first one, or -1 if
+  // there is no free run that long. Runs starting at goal are preferred.
+  int allocateRun(BitmapChanges *changes, int count, int goal = -1);
+  // Allocates bits start to start + count - 1 only if they are all free
+  bool allocateRange(BitmapChanges *changes, int start, int count);
+  void release(BitmapChanges *changes, int bit);
+  bool isAllocated(int bit);
+  // whether bit was allocated as of the last commit
+  bool isCommitted(int bit);
+
+  // Index of the first free (or allocated) bit at or after bit, numBits
+  // if there is none
+  int nextFree(int bit);
+  int nextAllocated(int bit);
+
+  // free bits that nobody has reserved
+  int numberOfFree();
+  int numberOfBits() { return numBits; }
+
+  // Copy the committed bitmap out in the on-disk byte layout
+  void read(unsigned char *bitmap);
+
+  // Applies changes to the committed bitmap and adds the bitmap blocks
+  // that changed to blocks, as new[] buffers the caller frees.
+  // rollback() gives back what changes allocated. Either way whatever is
+  // left of the reservation is returned and changes is emptied.
+  void commit(BitmapChanges *changes, std::map<unsigned int, unsigned char *> *blocks);
+  void rollback(BitmapChanges *changes);
+  // Makes the bits a commit released free to allocate again, once that
+  // commit is durable
+  void free(const std::vector<int> &released);
+
+ private:
+  BitmapAllocator(const BitmapAllocator &);
+  BitmapAllocator &operator=(const BitmapAllocator &);
+
+  int findFree(int bit);
+  int findAllocated(int bit);
+  int available(BitmapChanges *changes);
+  void claim(BitmapChanges *changes, int bit);
+  void countFree();
+
+  int bitmapAddr;
+  int bitmapLen;
+  int numBits;
+  int numFree;
+  int numReserved;
+  int hint;
+  pthread_mutex_t lock;
+
+  // every allocated bit, and the bits as of the last commit
+  std::vector<uint64_t> words;
+  std::vector<uint64_t> committed;
+};
+
+#endif
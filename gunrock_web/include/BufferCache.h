@@ -0,0 +1,85 @@
+#ifndef _BUFFER_CACHE_H_
+#define _BUFFER_CACHE_H_
+
+#include <map>
+#include <vector>
+
+#include <pthread.h>
+
+#include "Disk.h"
+
+// number of 4 KiB frames used when the caller does not pick a size
+#define DEFAULT_CACHE_BLOCKS (1024)
+
+/**
+ * A block cache that sits between the LocalFileSystem and the Disk.
+ *
+ * The cache holds up to a fixed number of block sized frames and evicts
+ * the least recently used one when it needs room. It only ever holds
+ * committed contents: transactions keep the blocks they write to
+ * themselves and hand them to commit(), which updates the cache and
+ * queues them on the disk. Every frame matches what the disk returns,
+ * so eviction never writes anything.
+ *
+ * The cache can be used from several threads. Misses are read from the
+ * disk without holding the cache's lock.
+ */
+class BufferCache {
+ public:
+  BufferCache(Disk *disk, int numFrames = DEFAULT_CACHE_BLOCKS);
+  ~BufferCache();
+
+  void readBlock(int blockNumber, void *buffer);
+  // Batched versions for a contiguous buffer of numBlocks blocks. The
+  // misses of a read are fetched from the disk with one readBlocks call.
+  void readBlocks(const unsigned int *blockNumbers, int numBlocks, void *buffer);
+
+  // Puts a transaction's blocks in the cache and queues them on the
+  // disk, returning the ticket to pass to Disk::waitForCommit
+  long commit(const std::map<unsigned int, unsigned char *> &blocks);
+
+  // Writes blocks home with Disk::writeUnjournaled and drops any frames
+  // they had, which only held what the blocks contained before they
+  // were freed
+  void writeUnjournaled(const unsigned int *blockNumbers, int numBlocks, const void *buffer);
+
+  // Drop every frame
+  void invalidate();
+
+  int numberOfFrames() { return numFrames; }
+  long hits() { return numHits; }
+  long misses() { return numMisses; }
+  void resetStats() { numHits = numMisses = 0; }
+
+ private:
+  struct Frame {
+    int blockNumber;
+    unsigned char *data;
+    // LRU list links, most recently used frame at the head
+    Frame *prev;
+    Frame *next;
+  };
+
+  BufferCache(const BufferCache &);
+  BufferCache &operator=(const BufferCache &);
+
+  Frame *findFrame(int blockNumber);
+  Frame *allocateFrame(int blockNumber);
+  void unlinkFrame(Frame *frame);
+  void pushFrame(Frame *frame);
+  void fillFrame(int blockNumber, const void *data);
+  void dropFrame(int blockNumber);
+
+  Disk *disk;
+  int numFrames;
+  pthread_mutex_t lock;
+  long numHits;
+  long numMisses;
+
+  Frame *lruHead;
+  Frame *lruTail;
+  std::map<int, Frame *> frames;
+  std::vector<Frame *> freeFrames;
+};
+
+#endif
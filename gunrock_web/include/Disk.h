@@ -2,30 +2,132 @@
 #define _DISK_H_
 
 #include <string>
-#include <deque>
+#include <map>
+#include <vector>
 
-struct UndoRecord {
-  int blockNumber;
-  unsigned char *blockData;
-};
+#include <pthread.h>
+
+#include <sys/uio.h>
 
+// Prefix an image file name with this to memory map the image instead of
+// using pread/pwrite, e.g. "mmap:disk.img".
+#define DISK_MMAP_PREFIX "mmap:"
+
+// Transactions hand the disk the new contents of a set of blocks.
+// commit() appends them to the journal (see super_t), makes it durable
+// with a single fdatasync (or msync for mapped images) and then writes
+// them to their home locations without waiting. Home locations are only
+// synced when the journal fills up and has to be reset. Opening a Disk
+// replays any committed transactions that are still in the journal.
+// Images without a journal write the blocks home and sync once at
+// commit. Writes outside of a transaction are synced immediately.
+//
+// Commits from several threads are grouped: queueCommit() only copies
+// the blocks, and the first thread to wait for its commit writes every
+// transaction queued so far as one journal transaction with one sync
+// while the others wait for it. Queued blocks are read back from memory
+// until they are home.
 class Disk {
  public:
   Disk(std::string imageFile, int blockSize);
+  ~Disk();
   void readBlock(int blockNumber, void *buffer);
   void writeBlock(int blockNumber, void *buffer);
   int numberOfBlocks();
 
-  void beginTransaction();
-  void commit();
-  void rollback();
-  
+  // Read or write numBlocks blocks to or from one contiguous buffer.
+  // Runs of physically adjacent block numbers are transferred with a
+  // single preadv/pwritev (or memcpy for mapped images).
+  void readBlocks(const unsigned int *blockNumbers, int numBlocks, void *buffer);
+  void writeBlocks(const unsigned int *blockNumbers, int numBlocks, const void *buffer);
+
+  // queueCommit copies blocks, keyed by block number, and returns a
+  // ticket that waitForCommit blocks on until they are durable
+  long queueCommit(const std::map<unsigned int, unsigned char *> &blocks);
+  void waitForCommit(long ticket);
+  void commit(const std::map<unsigned int, unsigned char *> &blocks);
+
+  // Writes blocks straight home without journaling them. Only for blocks
+  // nothing committed points at yet, like data blocks a transaction has
+  // just allocated, which it can then commit pointers to. The next
+  // commit makes them durable first and empties the journal, so that
+  // recovery can't replay an older copy of one of them over the new one.
+  void writeUnjournaled(const unsigned int *blockNumbers, int numBlocks, const void *buffer);
+
+  // Waits until none of the blocks are queued but not home yet, so the
+  // image file itself holds their latest contents. Together with
+  // fileDescriptor() that lets callers send blocks from the image with
+  // sendfile.
+  void waitUntilHome(const unsigned int *blockNumbers, int numBlocks);
+  int fileDescriptor() { return imageFileDescriptor; }
+
+  // number of blocks written to the image, journal blocks included
+  long blocksWritten() { return numBlocksWritten; }
+  void resetStats() { numBlocksWritten = 0; }
+
  private:
+  // the image file descriptor stays open for the lifetime of the Disk,
+  // so copying a Disk would close it twice
+  Disk(const Disk &);
+  Disk &operator=(const Disk &);
+
+  void readImage(int blockNumber, void *buffer);
+  void writeImage(int blockNumber, const void *buffer);
+  void transferImage(bool isWrite, int blockNumber, struct iovec *iov, int iovcnt);
+  void syncRange(int blockNumber, int numBlocks);
+  void markDirty(int blockNumber);
+  void syncDirty();
+
+  void openJournal();
+  void recoverJournal();
+  void resetJournal(unsigned int sequence);
+  void checkpointJournal();
+  void appendJournal(const std::map<unsigned int, unsigned char *> &blocks);
+
+  struct Commit {
+    long ticket;
+    std::map<unsigned int, unsigned char *> blocks;
+  };
+  void writeCommits(const std::vector<Commit *> &batch, int firstUnjournaled, int lastUnjournaled);
+  bool copyPending(const unsigned int *blockNumbers, int numBlocks, unsigned char *buffer,
+                   std::vector<bool> *copied);
+
   std::string imageFile;
+  int imageFileDescriptor;
+  bool isReadOnly;
+  // NULL unless the image was opened with DISK_MMAP_PREFIX
+  unsigned char *mappedImage;
+  // range of home blocks written but not synced yet
+  int firstDirtyBlock;
+  int lastDirtyBlock;
   int blockSize;
   int imageFileSize;
-  bool isInTransaction;
-  std::deque<struct UndoRecord> undoLog;
+  long numBlocksWritten;
+
+  // commits waiting to be written, and the newest queued contents of
+  // every block that is not home yet. lastTicket is the last ticket
+  // handed out, durableTicket the last one written, and only one thread
+  // at a time writes while isCommitting is set.
+  pthread_mutex_t lock;
+  pthread_cond_t committed;
+  std::vector<Commit *> queued;
+  std::map<unsigned int, unsigned char *> pending;
+  // pending.size(), which readers check without the lock
+  long numPending;
+  long lastTicket;
+  long durableTicket;
+  bool isCommitting;
+  // range of blocks writeUnjournaled has written since the last commit
+  // started, -1 if none
+  int firstUnjournaled;
+  int lastUnjournaled;
+
+  // journal region, journalLength is 0 if the image does not have one
+  int journalAddress;
+  int journalLength;
+  // next free journal block and the sequence of the next transaction
+  int journalHead;
+  unsigned int journalSequence;
 };
 
 #endif
@@ -8,11 +8,12 @@
 
 class DistributedFileSystemService : public HttpService {
  public:
-  DistributedFileSystemService(std::string driveFile);
+  DistributedFileSystemService(std::string driveFile, int cacheBlocks = DEFAULT_CACHE_BLOCKS);
 
   virtual void get(HTTPRequest *request, HTTPResponse *response);
   virtual void put(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
+  virtual long sizeHint(std::string path);
 
 private:
   LocalFileSystem *fileSystem;
@@ -11,10 +11,10 @@ class FileService : public HttpService {
 
   virtual void get(HTTPRequest *request, HTTPResponse *response);
   virtual void head(HTTPRequest *request, HTTPResponse *response);
+  virtual long sizeHint(std::string path);
 
 private:
   bool endswith(std::string str, std::string suffix);
-  std::string readFile(std::string path);
 
   std::string m_basedir;
 };
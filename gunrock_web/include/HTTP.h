@@ -7,9 +7,17 @@
 #include <vector>
 #include <map>
 
+// Takes the body of a message as it is parsed, instead of HTTP keeping
+// it for getBody
+class BodySink {
+ public:
+    virtual ~BodySink() {}
+    virtual void onBody(const char *data, size_t len) = 0;
+};
+
 class HTTP {
  public:
-    typedef enum {INIT, HEADER, FIELD, VALUE, BODY, DONE} HttpState;
+    typedef enum {INIT, HEADER, FIELD, VALUE, BODY, DONE, ERROR} HttpState;
 
     HTTP(http_parser_type httpType = HTTP_REQUEST);
     ~HTTP();
@@ -17,6 +25,8 @@ class HTTP {
     int addData(const unsigned char *data, int len);
     bool isDone();
     bool isHeaderDone();
+    // HTTP/1.1 without "Connection: close", or HTTP/1.0 with keep-alive
+    bool shouldKeepAlive();
     std::string getProxyRequest(const char *userAgent = NULL);
     std::string getReplyHeader();
     std::string getHost();
@@ -30,6 +40,9 @@ class HTTP {
     bool isDelete() {return m_method == HTTP_DELETE;}
     bool isMove() {return m_method == HTTP_MOVE;}
     std::string getBody();
+    // Hands the body parsed so far to sink, and the rest as it comes.
+    // NULL goes back to keeping it.
+    void setBodySink(BodySink *sink);
     std::string getQuery() {return m_query;}
     std::vector< std::pair< std::string *, std::string *> > getHeaders() {
       return m_headers;
@@ -70,6 +83,7 @@ class HTTP {
     std::string *m_value;
     std::vector< std::pair< std::string *, std::string *> > m_headers;
     std::string m_body;
+    BodySink *m_bodySink;
     std::string m_statusStr;
     unsigned char m_method;
     http_parser_type m_httpType;
@@ -19,12 +19,24 @@ public:
   
   bool readRequest();
 
+  // For callers that read the socket themselves, e.g. without blocking:
+  // parse up to len bytes of the request. Parsing stops at the end of
+  // the request, so the bytes of a pipelined request that follows are
+  // left over. Returns how many bytes were used, -1 if they are not
+  // valid HTTP.
+  int addData(const char *buffer, unsigned int len);
+  bool isDone() {return m_http->isDone();}
+  bool isHeaderDone() {return m_http->isHeaderDone();}
+  bool keepAlive() {return m_http->shouldKeepAlive();}
+
   std::string getHost();
   std::string getRequest();
   std::string getUrl();
   std::string getPath();
   std::vector<std::string> getPathComponents();
   std::string getHeader(std::string key);
+  // Looks key up ignoring case, false if the request doesn't have it
+  bool findHeader(std::string key, std::string *value);
   bool hasAuthToken();
   std::string getAuthToken();
   bool isConnect();
@@ -36,18 +48,30 @@ public:
   bool isMove() {return m_http->isMove();}
   std::map<std::string, std::string> getParams();
   WwwFormEncodedDict formEncodedBody();
-  std::string getBody() {return m_http->getBody();}
+  // The body may still be on the socket when a service gets the
+  // request. getBody reads all of it first. readBody passes it to sink
+  // as it arrives instead, or throws it away if sink is NULL, so large
+  // bodies never have to be in memory at once. It returns false if the
+  // connection fails before the end of the request. Bytes read past the
+  // end, e.g. of a pipelined request, are left for takeLeftover. A
+  // client that sent "Expect: 100-continue" is told to go ahead first.
+  std::string getBody();
+  bool readBody(BodySink *sink);
+  std::string takeLeftover();
   
   void printDebugInfo();
     
  protected:
     void onRead(const char *buffer, unsigned int len);
+    void readRest();
 
     MySocket *m_sock;
     HTTP *m_http;
     int m_serverPort;
     unsigned long m_totalBytesRead;
     unsigned long m_totalBytesWritten;
+    std::string m_leftover;
+    bool m_continueSent;
 };
 
 #endif
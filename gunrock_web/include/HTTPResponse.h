@@ -4,25 +4,76 @@
 #include <map>
 #include <string>
 
+#include <sys/uio.h>
+
+#include "MySocket.h"
+
+// bytes of a streamed body read and written at a time
+#define STREAM_BUFFER_SIZE (4096)
+
+// room for the status line and headers inside the response, enough for
+// everything the services set. Longer ones spill into a string.
+#define HEAD_BUFFER_SIZE (1024)
+
+// Produces a streamed body a piece at a time, see setBodySource
+class BodySource {
+ public:
+  virtual ~BodySource() {}
+  // Fills up to size bytes of buffer with the next piece of the body.
+  // Returns how many bytes, 0 at the end and -1 if it failed.
+  virtual int read(char *buffer, int size) = 0;
+  // Sources whose bytes sit in a file can instead hand out where the
+  // next up to size of them are, so they go to the socket with
+  // sendfile. Sets fd and offset and returns how many bytes are there
+  // in a row, 0 at the end and -1 to have this piece read() instead.
+  virtual long nextExtent(int *fd, off_t *offset, long size) { return -1; }
+};
+
 class HTTPResponse {
  public:
   HTTPResponse();
+  ~HTTPResponse();
   void withStreaming();
+  // Sends the body from source, which the response deletes, after the
+  // headers instead of a body set with setBody. Bodies of a known
+  // length go out with a Content-Length, others (length -1) chunked.
+  void setBodySource(BodySource *source, long length = -1);
+  // Writes the status line and headers and then the body. A body set
+  // with setBody goes out in the same writev as the headers, without
+  // being copied, and one from a source follows them. Returns false if
+  // the source failed or came up short, which leaves the connection
+  // unusable.
+  bool write(MySocket *client);
   void setHeader(std::string name, std::string value);
   void setBody(std::string data);
   void setContentType(std::string contentType);
   void setStatus(int status);
   int getStatus();
+  // what write() sends, except a body from a source, as one string
   std::string response();
 
  private:
-  std::string statusToString();
+  // the response owns its body source
+  HTTPResponse(const HTTPResponse &);
+  HTTPResponse &operator=(const HTTPResponse &);
+
+  const char *statusToString();
+  void appendHead(const char *data, size_t len);
+  void appendHeader(const char *name, const char *value, size_t valueLength);
+  struct iovec formatHead();
+  bool hasInlineBody();
+  bool writeBody(MySocket *client);
 
   int status;
   bool streaming;
   std::map<std::string, std::string> headers;
   std::string body;
   std::string contentType;
+  BodySource *source;
+  long sourceLength;
+  char head[HEAD_BUFFER_SIZE];
+  size_t headLength;
+  std::string headOverflow;
 };
 
 #endif
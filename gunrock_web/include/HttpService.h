@@ -19,6 +19,11 @@ class HttpService {
   virtual void post(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
   virtual void move(HTTPRequest *request, HTTPResponse *response);
+
+  // Roughly how many bytes a GET of path would send back, so the
+  // smallest-file-first scheduler can order requests. 0 if unknown.
+  // Runs on the event loop, so it must not block.
+  virtual long sizeHint(std::string path);
   
  private:
   std::string m_pathPrefix;
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <sstream>
+#include <time.h>
 #include <stdexcept>
 #include <vector>
 #include <map>
@@ -20,6 +21,18 @@ class HttpUtils {
   static void writeChunk(MySocket *client, const void *buf, int numBytes);
   static void writeLastChunk(MySocket *client);
 
+  // HTTP dates, e.g. "Sun, 06 Nov 1994 08:49:37 GMT". parseDate returns
+  // -1 for anything else.
+  static std::string formatDate(time_t time);
+  static time_t parseDate(const std::string &date);
+
+  // Parses a Range header for a body of length bytes. Only a single
+  // "bytes=" range is supported. Returns 1 and the first and last byte
+  // of the range, 0 if the range is past the end of the body, or -1 if
+  // the header is malformed or asks for several ranges, which callers
+  // answer with the whole body.
+  static int parseRange(const std::string &range, long length, long *first, long *last);
+
   static std::vector<std::string> split(const std::string &s, char delim);
 
  private:
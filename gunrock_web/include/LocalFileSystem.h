@@ -1,8 +1,16 @@
 #ifndef _LOCAL_FILE_SYSTEM_H_
 #define _LOCAL_FILE_SYSTEM_H_
 
+#include <map>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include <pthread.h>
+
+#include "BitmapAllocator.h"
+#include "BufferCache.h"
 #include "Disk.h"
 #include "ufs.h"
 
@@ -13,6 +21,20 @@
  * you will implement. This class uses our Disk class for accessing disk blocks
  * on the underlying storage stack.
  *
+ * Block I/O goes through a BufferCache of cacheBlocks frames, so callers
+ * that modify the file system should wrap their changes in
+ * beginTransaction() and commit() or rollback() on this class rather than
+ * on the Disk directly.
+ *
+ * The file system can be used from several threads at once, each with
+ * its own transaction. Every inode has a reader-writer lock: reads hold
+ * it shared, and a commit holds it exclusively while it makes the
+ * inode's changes visible. A transaction that changes an inode becomes
+ * its owner until it ends, so changes to one inode are serialized while
+ * readers keep seeing the last committed version, and changes to
+ * unrelated inodes run in parallel. Transactions take ownership of a
+ * directory before anything in it, which keeps them from deadlocking.
+ *
  * One important aspect of this interface is that the buffers and sizes that
  * callers operate will not align on disk block boundaries, so your job is
  * to manage the interactions with the underlying storage to provide a higher
@@ -43,10 +65,20 @@
 #define EINVALIDTYPE       (9)
 // Unlinking '.' or '..'
 #define EUNLINKNOTALLOWED  (10)
+// Modifying an image whose format predates indirect blocks
+#define EREADONLY          (11)
+
+// lookup results the dentry cache holds before it starts over
+#define DENTRY_CACHE_SIZE  (65536)
+
+// blocks a transaction keeps in memory before new file data is written
+// straight home, see writeData
+#define TRANSACTION_BLOCKS (64)
 
 class LocalFileSystem {
  public:
-  LocalFileSystem(Disk *disk);
+  LocalFileSystem(Disk *disk, int cacheBlocks = DEFAULT_CACHE_BLOCKS);
+  ~LocalFileSystem();
   /**
    * Lookup an inode.
    *
@@ -54,12 +86,29 @@ class LocalFileSystem {
    * of a directory) and looks up the entry name in it. The inode
    * number of name is returned.
    *
+   * Results, including names that were not found, are kept in a
+   * dentry cache that commits keep up to date, so looking a name up
+   * again does not read the directory.
+   *
    * Success: return inode number of name
    * Failure: return -ENOTFOUND, -EINVALIDINODE.
    * Failure modes: invalid parentInodeNumber, name does not exist.
    */
   int lookup(int parentInodeNumber, std::string name);
 
+  /**
+   * Lookup an inode in the dentry cache only.
+   *
+   * Unlike lookup this takes no inode locks and never reads the
+   * directory, so it can't wait behind a commit. It is only a hint: a
+   * name that was never looked up isn't found, and the answer may be
+   * stale by the time it is used.
+   *
+   * Success: return inode number of name
+   * Failure: return -ENOTFOUND if the name isn't cached or doesn't exist
+   */
+  int cachedLookup(int parentInodeNumber, std::string name);
+
   /**
    * Read an inode.
    *
@@ -113,6 +162,58 @@ class LocalFileSystem {
    */
   int write(int inodeNumber, const void *buffer, int size);
 
+  /**
+   * Write part of a file.
+   *
+   * Writes size bytes at `offset` without touching the rest of the file,
+   * growing it if the write goes past the end. Only the blocks covering
+   * the range are rewritten, partial blocks are read first. A gap between
+   * the old end of the file and offset reads back as zeros. append writes
+   * at the current end of the file.
+   *
+   * Success: number of bytes written
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE, -ENOTENOUGHSPACE.
+   * Failure modes: invalid inodeNumber, invalid size or offset, or the
+   * write would go past MAX_FILE_SIZE, not a regular file.
+   */
+  int writeAt(int inodeNumber, const void *buffer, int size, int offset);
+  int append(int inodeNumber, const void *buffer, int size);
+
+  /**
+   * List the disk blocks of a file or directory, in file order.
+   *
+   * Block numbers come from the inode's direct pointers and, on images
+   * with format version 1, from its indirect blocks.
+   *
+   * Success: return 0
+   * Failure: return -EINVALIDINODE
+   */
+  int getFileBlocks(int inodeNumber, std::vector<unsigned int> *blocks);
+
+  /**
+   * Find where part of a file is in the disk image.
+   *
+   * Sets imageOffset to where the byte `offset` bytes into the file is
+   * in the image (see Disk::fileDescriptor) and returns how many bytes
+   * from there on, up to size, are stored contiguously, so they can be
+   * sent straight from the image. Blocks that commits have queued are
+   * written home first. The image only has committed contents, so this
+   * is not for files the calling thread is changing.
+   *
+   * Success: number of bytes, 0 if offset is at or past the end
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE
+   */
+  int getFileExtent(int inodeNumber, int offset, int size, long *imageOffset);
+
+  // Largest file the image format supports, in bytes. Images older than
+  // UFS_VERSION_INDIRECT are mounted read-only: create, write, writeAt,
+  // append and unlink return -EREADONLY on them.
+  int maxFileSize();
+
+  // When the file was last written, in seconds since the epoch, 0 if the
+  // image format has no modification times or the file was never written
+  long modificationTime(const inode_t *inode);
+
   /**
    * Read the contents of a file or directory.
    *
@@ -126,6 +227,50 @@ class LocalFileSystem {
    */
   int read(int inodeNumber, void *buffer, int size);
 
+  /**
+   * Read part of a file or directory.
+   *
+   * Like read, but starts `offset` bytes into the file, the way pread
+   * does. Only the blocks covering the range are read, and the range is
+   * cut short at the end of the file.
+   *
+   * Success: number of bytes read, 0 if offset is at or past the end
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE.
+   * Failure modes: invalid inodeNumber, invalid size or negative offset.
+   */
+  int readAt(int inodeNumber, void *buffer, int size, int offset);
+
+  /**
+   * Read a file in pieces.
+   *
+   * openFile locks the inode shared until the matching closeFile, so
+   * every readAt and stat of it in between, from the same thread, sees
+   * one version of the file no matter how long the reads are spread
+   * out, e.g. while each piece is sent to a client. Commits that change
+   * the file wait for closeFile, so a thread must not change a file it
+   * has open. They wait before they take the lock that orders commits,
+   * so commits to other files go ahead meanwhile.
+   *
+   * Success: return 0
+   * Failure: return -EINVALIDINODE
+   */
+  int openFile(int inodeNumber);
+  void closeFile(int inodeNumber);
+
+  /**
+   * List a directory.
+   *
+   * Fills entries with the directory's entries in on-disk order, "."
+   * and ".." first, leaving out unused slots. Use this rather than read
+   * to list a directory, since large directories are hashed and have
+   * free slots scattered through them.
+   *
+   * Success: return 0
+   * Failure: return -EINVALIDINODE
+   * Failure modes: invalid inodeNumber, not a directory.
+   */
+  int readDirectory(int inodeNumber, std::vector<dir_ent_t> *entries);
+
   /**
    * Remove a file or directory.
    *
@@ -140,6 +285,34 @@ class LocalFileSystem {
    * a failure by our definition. You can't unlink '.' or '..'
    */
   int unlink(int parentInodeNumber, std::string name);
+
+  /**
+   * Transactions.
+   *
+   * Transactions belong to the thread that began them. Changes made
+   * between beginTransaction() and commit() are kept in the transaction,
+   * where only its own thread sees them, and written to disk together at
+   * commit. commit() returns once they are durable, but other threads
+   * see them as soon as they are queued, and concurrent commits share
+   * one journal write. rollback() discards them. A change made outside
+   * of a transaction is committed on its own.
+   */
+  void beginTransaction();
+  void commit();
+  void rollback();
+  bool isInTransaction();
+
+  /**
+   * Read or write a single inode.
+   *
+   * The inode table is cached a block at a time, so readInode only reads
+   * the block of the inode region that holds inodeNumber. writeInode
+   * keeps the inode in the transaction until it commits. Callers must
+   * check that inodeNumber is in range, and writeInode does not take
+   * ownership of the inode.
+   */
+  void readInode(int inodeNumber, inode_t *inode);
+  void writeInode(int inodeNumber, const inode_t *inode);
   
   /**
    * Some helper functions that you need to implement and use in your
@@ -153,7 +326,9 @@ class LocalFileSystem {
    * numDataBytesNeeded is converted to blocks and added to numDataBlocksNeeded
    * Having two separate arguments for data helps for operations that write
    * new data to two separate entities. If you don't need a value
-   * you can set the number needed to 0.
+   * you can set the number needed to 0. Inside a transaction the space
+   * is reserved for it until it ends, so other transactions can't use it
+   * up in the meantime.
    */
   bool diskHasSpace(super_t *super, int numInodesNeeded, int numDataBytesNeeded, int numDataBlocksNeeded=0);
 
@@ -169,6 +344,93 @@ class LocalFileSystem {
   // it in a function you add that is not part of the LocalFileSystem object but
   // can still access the disk.
   Disk *disk;
+  BufferCache *cache;
+
+ private:
+  LocalFileSystem(const LocalFileSystem &);
+  LocalFileSystem &operator=(const LocalFileSystem &);
+
+  // what one transaction has changed, nothing in it is visible to other
+  // threads until commit
+  struct Transaction {
+    // new contents of the blocks and inodes it wrote
+    std::map<unsigned int, unsigned char *> blocks;
+    std::map<int, inode_t> inodes;
+    BitmapChanges inodeChanges;
+    BitmapChanges dataChanges;
+    // lookups in directories it owns, and directories it removed
+    std::map<std::pair<int, std::string>, int> dentries;
+    std::vector<int> removedDirectories;
+    // inodes it owns until it ends
+    std::set<int> owned;
+  };
+  class ReadGuard;
+
+  Transaction *currentTransaction();
+  void endTransaction(Transaction *txn);
+  void ownInode(int inodeNumber);
+  pthread_rwlock_t *lockShared(int inodeNumber);
+
+  // block I/O that sees the current transaction's writes
+  void readBlock(unsigned int blockNumber, void *buffer);
+  void readBlocks(const unsigned int *blockNumbers, int numBlocks, void *buffer);
+  void writeBlock(unsigned int blockNumber, const void *buffer);
+  void writeBlocks(const unsigned int *blockNumbers, int numBlocks, const void *buffer);
+  void writeData(const unsigned int *blockNumbers, int numBlocks, const void *buffer);
+
+  void extendFile(inode_t *inode, int currentBlocks, int newBlocks);
+  void writeSpan(const inode_t *inode, int existingBlocks, const char *src, int offset, int size);
+  void touch(inode_t *inode);
+
+  // directory entries, see DIR_HASH_MAGIC in ufs.h for the hashed format
+  bool isHashedDirectory(const inode_t *dir);
+  void listEntries(const inode_t *dir, std::vector<dir_ent_t> *entries);
+  int findEntry(const inode_t *dir, const std::string &name, unsigned int *blockNumber, int *slot);
+  int addEntry(inode_t *dir, const std::string &name, int inodeNumber);
+  int removeEntry(inode_t *dir, const std::string &name);
+  int rehashDirectory(inode_t *dir, const std::vector<dir_ent_t> &entries, int numBuckets);
+  void cacheDentry(int parentInodeNumber, const std::string &name, int inodeNumber);
+  void forgetDirectory(int inodeNumber);
+
+  // map file block indexes to disk blocks through the inode's pointers
+  unsigned int fileBlock(const inode_t *inode, int index);
+  void mapFileBlocks(const inode_t *inode, int first, int count, unsigned int *blocks);
+  void setFileBlocks(inode_t *inode, int first, int count, const unsigned int *blocks);
+  void truncateFileBlocks(inode_t *inode, int oldBlocks, int newBlocks);
+  unsigned int allocatePointerBlock(unsigned int nearBlock);
+  int pointerBlocksNeeded(int numBlocks);
+  int blocksToGrow(int oldBlocks, int newBlocks);
+  inode_t *loadInodeBlock(int block);
+
+  // read once at construction, nothing changes the superblock afterwards
+  super_t superBlock;
+  bool isReadOnly;
+
+  // the calling thread's Transaction, NULL outside of one
+  pthread_key_t transactionKey;
+  // the inodes the calling thread has open, and how many times
+  pthread_key_t openFilesKey;
+  // one owner mutex and one reader-writer lock per inode
+  pthread_mutex_t *inodeOwners;
+  pthread_rwlock_t *inodeLocks;
+  // commits make their changes visible one at a time, in the order
+  // they are queued on the disk
+  pthread_mutex_t commitLock;
+
+  // in-memory copies of the inode and data bitmaps
+  BitmapAllocator *inodeAllocator;
+  BitmapAllocator *dataAllocator;
+
+  // committed blocks of the inode table, keyed by block within the
+  // inode region
+  int inodesPerBlock;
+  std::map<int, inode_t *> inodeBlocks;
+  pthread_mutex_t inodeBlocksLock;
+
+  // (parent inode, name) to the inode number lookup returned for it,
+  // -ENOTFOUND for names that are not there, as of the last commit
+  std::map<std::pair<int, std::string>, int> dentries;
+  pthread_mutex_t dentriesLock;
 };  
 
 #endif
@@ -12,6 +12,27 @@
 
 #define MAX_FILE_SIZE (DIRECT_PTRS * UFS_BLOCK_SIZE)
 
+// On-disk format versions, kept in super_t.version. Images made before
+// the field existed read as version 0: every slot of direct[] is a data
+// block, so files stop at MAX_FILE_SIZE. Those images are mounted
+// read-only. Version 1 inodes keep NUM_DIRECT_BLOCKS direct pointers and
+// use the last three slots of direct[] for a single indirect block, a
+// double indirect block and the modification time. An indirect block is
+// PTRS_PER_BLOCK block numbers; a pointer of 0 (or -1, as mkfs leaves
+// unused slots) means the block has not been allocated.
+#define UFS_VERSION_DIRECT (0)
+#define UFS_VERSION_INDIRECT (1)
+#define UFS_VERSION (UFS_VERSION_INDIRECT)
+
+#define NUM_DIRECT_BLOCKS (27)
+#define INDIRECT_PTR (27)
+#define DOUBLE_INDIRECT_PTR (28)
+#define MTIME_PTR (29)
+#define PTRS_PER_BLOCK (UFS_BLOCK_SIZE / 4)
+
+// sizes are ints, so version 1 files stop at the last whole block below 2 GiB
+#define MAX_INDIRECT_FILE_SIZE (0x7ffff000)
+
 // Note: Bitmap indexes identify disk blocks relative to the start of a region.
 
 typedef struct {
@@ -26,6 +47,18 @@ typedef struct {
     int  inum;      // inode number of entry (-1 means entry not used)
 } dir_ent_t;
 
+#define DIR_ENTS_PER_BLOCK (UFS_BLOCK_SIZE / (int)sizeof(dir_ent_t))
+
+// A directory starts out as a plain array of entries. Once it needs a
+// second block it is turned into a hashed directory: its size is a power
+// of two number of blocks, and block k holds the entries whose name
+// hashes (32-bit FNV-1a) to k modulo that number, in any slot, with
+// inum -1 marking unused slots. "." and ".." stay the first two entries
+// of block 0, and the "." entry carries DIR_HASH_MAGIC at the end of its
+// name so readers can tell the two formats apart.
+#define DIR_HASH_MAGIC "#hashed"
+#define DIR_HASH_MAGIC_OFFSET (DIR_ENT_NAME_SIZE - (int)sizeof(DIR_HASH_MAGIC))
+
 // presumed: block 0 is the super block
 typedef struct __super {
     int inode_bitmap_addr; // block address (in blocks)
@@ -38,7 +71,32 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    int journal_addr;      // block address (in blocks), 0 if there is no journal
+    int journal_len;       // in blocks
+    int version;           // UFS_VERSION_DIRECT or UFS_VERSION_INDIRECT
 } super_t;
 
+// The journal is a redo log. Its first block is a journal super block
+// whose sequence is the sequence number of the first transaction in the
+// log. Each transaction follows it as a descriptor block, listing the
+// home block numbers, then the new contents of those blocks, then a
+// commit block holding a checksum of the descriptor and the contents.
+// A transaction only counts if its commit block is intact.
+#define UFS_JOURNAL_MAGIC (0x4c4e524a)
+#define UFS_JOURNAL_SUPER (1)
+#define UFS_JOURNAL_DESCRIPTOR (2)
+#define UFS_JOURNAL_COMMIT (3)
+
+typedef struct {
+    unsigned int magic;     // UFS_JOURNAL_MAGIC
+    unsigned int type;      // UFS_JOURNAL_SUPER, _DESCRIPTOR or _COMMIT
+    unsigned int sequence;  // transaction sequence number
+    unsigned int num_blocks; // descriptor: number of block numbers that follow
+    unsigned int checksum;  // commit: checksum of the descriptor and contents
+} journal_header_t;
+
+// block numbers that fit in a descriptor block after its header
+#define JOURNAL_DESCRIPTOR_ENTRIES ((UFS_BLOCK_SIZE - sizeof(journal_header_t)) / sizeof(unsigned int))
+
 
 #endif // __ufs_h__
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+
+#include <stdlib.h>
+
+#include "Disk.h"
+#include "LocalFileSystem.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Reports how many bytes reach the disk for each PUT, i.e. a create plus
+// a write inside one transaction, the way DistributedFileSystemService
+// does it. The "region" rows also read and rewrite the whole inode table
+// in every transaction, which is what create/write/unlink used to do, so
+// running this on images with more and more inodes shows that cost
+// growing with the table while single inode updates stay flat.
+
+static long put(LocalFileSystem &fs, Disk &disk, string name, const char *data, int size,
+                bool rewriteRegion) {
+  disk.resetStats();
+  fs.beginTransaction();
+  int inodeNumber = fs.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_REGULAR_FILE, name);
+  if (inodeNumber < 0 || fs.write(inodeNumber, data, size) != size) {
+    cerr << "could not write " << name << endl;
+    exit(1);
+  }
+  if (rewriteRegion) {
+    super_t super;
+    fs.readSuperBlock(&super);
+    vector<inode_t> inodes(super.num_inodes);
+    fs.readInodeRegion(&super, inodes.data());
+    fs.writeInodeRegion(&super, inodes.data());
+  }
+  fs.commit();
+  return disk.blocksWritten() * UFS_BLOCK_SIZE;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    cout << argv[0] << ": diskImageFile [puts]" << endl;
+    return 1;
+  }
+
+  int puts = argc > 2 ? atoi(argv[2]) : 50;
+  Disk disk(argv[1], UFS_BLOCK_SIZE);
+  LocalFileSystem fs(&disk);
+  super_t super;
+  fs.readSuperBlock(&super);
+
+  char data[1024];
+  memset(data, 'x', sizeof(data));
+
+  const char *modes[] = {"region", "inode"};
+  for (int mode = 0; mode < 2; mode++) {
+    long bytes = 0;
+    for (int i = 0; i < puts; i++) {
+      bytes += put(fs, disk, string(modes[mode]) + to_string(i), data, sizeof(data), mode == 0);
+    }
+    cout << super.num_inodes << " inodes\t" << modes[mode] << "\t"
+         << bytes / puts << " bytes written per PUT" << endl;
+  }
+
+  return 0;
+}
@@ -3,12 +3,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ufs.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-j <num_journal_blocks>] [-F <format_version>]\n");
     exit(1);
 }
 
@@ -17,9 +18,11 @@ int main(int argc, char *argv[]) {
     char *image_file = NULL;
     int num_inodes = 32;
     int num_data = 32;
+    int num_journal = 64;
+    int version = UFS_VERSION;
     int visual = 0;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:j:F:v")) != -1) {
 	switch (ch) {
 	case 'i':
 	    num_inodes = atoi(optarg);
@@ -30,6 +33,12 @@ int main(int argc, char *argv[]) {
 	case 'f':
 	    image_file = optarg;
 	    break;
+	case 'j':
+	    num_journal = atoi(optarg);
+	    break;
+	case 'F':
+	    version = atoi(optarg);
+	    break;
 	case 'v':
 	    visual = 1;
 	    break;
@@ -58,6 +67,8 @@ int main(int argc, char *argv[]) {
 
     assert(num_inodes >= 32);
     assert(num_data >= 32);
+    assert(num_journal == 0 || num_journal >= 3);
+    assert(version == UFS_VERSION_DIRECT || version == UFS_VERSION_INDIRECT);
 
     // presumed: block 0 is the super block
     super_t s;
@@ -91,7 +102,12 @@ int main(int argc, char *argv[]) {
     s.data_region_addr = s.inode_region_addr + s.inode_region_len;
     s.data_region_len = num_data;
 
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
+    // journal, zeroed blocks are an empty journal
+    s.journal_addr = num_journal > 0 ? s.data_region_addr + s.data_region_len : 0;
+    s.journal_len = num_journal;
+    s.version = version;
+
+    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len + s.journal_len;
 
     // super block is the first block
     int rc = pwrite(fd, &s, sizeof(super_t), 0);
@@ -106,6 +122,8 @@ int main(int argc, char *argv[]) {
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
+    printf("  journal address/len      %d [%d]\n", s.journal_addr, s.journal_len);
+    printf("  format version           %d\n", s.version);
 
     // first, zero out all the blocks
     int i;
@@ -153,6 +171,11 @@ int main(int argc, char *argv[]) {
     itable.inodes[0].direct[0] = s.data_region_addr;
     for (i = 1; i < DIRECT_PTRS; i++)
 	itable.inodes[0].direct[i] = -1;
+    if (version >= UFS_VERSION_INDIRECT) {
+	itable.inodes[0].direct[INDIRECT_PTR] = 0;
+	itable.inodes[0].direct[DOUBLE_INDIRECT_PTR] = 0;
+	itable.inodes[0].direct[MTIME_PTR] = time(NULL);
+    }
 
     rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
@@ -192,6 +215,8 @@ int main(int argc, char *argv[]) {
 	    printf("I");
 	for (i = 0; i < s.data_region_len; i++)
 	    printf("D");
+	for (i = 0; i < s.journal_len; i++)
+	    printf("J");
 	printf("\n\n");
     }
 
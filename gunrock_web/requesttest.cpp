@@ -0,0 +1,62 @@
+#include <iostream>
+#include <string>
+
+#include <stdlib.h>
+
+#include "MySocket.h"
+
+using namespace std;
+
+// Sends malformed requests to a running gunrock_web and checks that only
+// the connection they came on is closed: each one must get no response,
+// and a well formed request on a new connection afterwards must still be
+// answered.
+
+// sends request on a new connection and returns everything read until
+// the server closes it
+static string send(int port, const string &request) {
+  MySocket client("localhost", port);
+  client.write(request);
+  string response;
+  try {
+    while (true) {
+      response += client.read();
+    }
+  } catch (SocketReadError &) {
+  }
+  client.close();
+  return response;
+}
+
+static bool closes(int port, const string &name, const string &request) {
+  string response = send(port, request);
+  if (!response.empty()) {
+    cout << name << ": expected the connection to be closed, got " << response.substr(0, 64) << endl;
+    return false;
+  }
+  if (send(port, "GET /ds3/ HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n")
+          .compare(0, 12, "HTTP/1.1 200") != 0) {
+    cout << name << ": the server stopped answering" << endl;
+    return false;
+  }
+  cout << name << ": ok" << endl;
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    cout << argv[0] << ": port" << endl;
+    return 1;
+  }
+  int port = atoi(argv[1]);
+
+  bool ok = true;
+  try {
+    ok &= closes(port, "fragment", "GET /ds3/x#y HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    ok &= closes(port, "fragment after query", "GET /ds3/?a=b#y HTTP/1.1\r\nHost: localhost\r\n\r\n");
+  } catch (exception &e) {
+    cout << e.what() << endl;
+    return 1;
+  }
+  return ok ? 0 : 1;
+}
@@ -7,46 +7,96 @@
 #include <errno.h>
 
 #include <sstream>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <strings.h>
 
 using namespace std;
 
-HTTPClientResponse::HTTPClientResponse(MySocket *sock) {
+HTTPClientResponse::HTTPClientResponse(MySocket *sock, string *pending) {
     m_sock = sock;
+    m_pending = pending;
     m_status_code = 0;
+    m_keep_alive = false;
 }
 
+bool HTTPClientResponse::readMore(string &data) {
+  try {
+    data += m_sock->read();
+    return true;
+  } catch (...) {
+    return false;
+  }
+}
 
 string HTTPClientResponse::readResponse() {
   string full_response;
-
-  while (true) {
-    string response;
-    try {
-      response = m_sock->read();
-    } catch (...) {
-      break;
-    }
-
-    full_response += response;
+  if (m_pending != NULL) {
+    full_response.swap(*m_pending);
   }
 
-  size_t delimiter = full_response.find("\r\n\r\n");
-  if (delimiter == string::npos) {
-    return "";
+  size_t delimiter;
+  while ((delimiter = full_response.find("\r\n\r\n")) == string::npos) {
+    if (!readMore(full_response)) {
+      return "";
+    }
   }
 
-  m_body = full_response.substr(delimiter+4);
   string header_string = full_response.substr(0, delimiter);
   stringstream header_stream(header_string);
 
   string line;
   while (getline(header_stream, line)) {
+    if (line.size() > 0 && line[line.size() - 1] == '\r') {
+      line.erase(line.size() - 1);
+    }
+    size_t colon = line.find(':');
     if (line.find("HTTP/1.1 ") == 0 || line.find("HTTP/1.0") == 0) {
       stringstream header_line(line);
       string http;
       header_line >> http >> m_status_code >> m_status_message;
+      m_keep_alive = line.find("HTTP/1.1 ") == 0;
+    } else if (colon != string::npos) {
+      // header names are case insensitive, keep them in lower case
+      string key = line.substr(0, colon);
+      transform(key.begin(), key.end(), key.begin(), ::tolower);
+      size_t value = line.find_first_not_of(' ', colon + 1);
+      m_headers[key] = value == string::npos ? "" : line.substr(value);
     }
   }
+
+  map<string, string>::iterator connection = m_headers.find("connection");
+  if (connection != m_headers.end()) {
+    m_keep_alive = strcasecmp(connection->second.c_str(), "keep-alive") == 0;
+  }
+
+  size_t body_start = delimiter + 4;
+  map<string, string>::iterator length = m_headers.find("content-length");
+  bool no_body = m_status_code == 204 || m_status_code == 304 || m_status_code / 100 == 1;
+  if (no_body) {
+    m_headers["content-length"] = "0";
+    length = m_headers.find("content-length");
+  } else if (length == m_headers.end()) {
+    // the body runs until the server closes the connection
+    while (readMore(full_response)) {
+    }
+    m_body = full_response.substr(body_start);
+    m_keep_alive = false;
+    return m_body;
+  }
+
+  size_t body_length = strtoul(length->second.c_str(), NULL, 10);
+  while (full_response.size() < body_start + body_length) {
+    if (!readMore(full_response)) {
+      m_keep_alive = false;
+      break;
+    }
+  }
+  m_body = full_response.substr(body_start, body_length);
+  if (m_pending != NULL && full_response.size() > body_start + body_length) {
+    *m_pending = full_response.substr(body_start + body_length);
+  }
   
   return m_body;
 }
@@ -8,24 +8,36 @@
 using namespace std;
 
 HttpClient::HttpClient(const char *inet_addr, int port, bool use_tls) {
-  if (use_tls) {
-    connection = new MySslSocket(inet_addr, port);
-  } else {
-    connection = new MySocket(inet_addr, port);
-  }
+  this->inet_addr = inet_addr;
+  this->port = port;
+  this->use_tls = use_tls;
+  connection = NULL;
+  connect();
   
   stringstream host;
   host << inet_addr << ":" << port;
   headers["Host"] = host.str();
   headers["User-Agent"] = string("Gunrock/1.0");
   headers["Accept"] = string("*/*");
-  headers["Connection"] = string("close");
+  headers["Connection"] = string("keep-alive");
 }
 
 HttpClient::~HttpClient() {
   delete connection;
 }
 
+void HttpClient::connect() {
+  delete connection;
+  connection = NULL;
+  if (use_tls) {
+    connection = new MySslSocket(inet_addr.c_str(), port);
+  } else {
+    connection = new MySocket(inet_addr.c_str(), port);
+  }
+  num_responses = 0;
+  pending = "";
+}
+
 void HttpClient::set_header(string key, string value) {
   headers[key] = value;
 }
@@ -67,27 +79,53 @@ void HttpClient::write_request(string path, string method, string body) {
 
 
 HTTPClientResponse *HttpClient::read_response() {
-  HTTPClientResponse *response = new HTTPClientResponse(connection);
+  HTTPClientResponse *response = new HTTPClientResponse(connection, &pending);
   response->readResponse();
+  num_responses++;
+  if (!response->keepAlive()) {
+    connection->close();
+  }
+  return response;
+}
+
+HTTPClientResponse *HttpClient::send_request(string path, string method, string body) {
+  // a connection that has been idle may have been closed by the server
+  // without us noticing until now. POSTs aren't safe to send twice, so
+  // they are never retried
+  bool retry = num_responses > 0 && method != "POST";
+  try {
+    write_request(path, method, body);
+  } catch (...) {
+    if (!retry) {
+      throw;
+    }
+    connect();
+    write_request(path, method, body);
+    return read_response();
+  }
+
+  HTTPClientResponse *response = read_response();
+  if (response->status() == 0 && retry) {
+    delete response;
+    connect();
+    write_request(path, method, body);
+    response = read_response();
+  }
   return response;
 }
 
 HTTPClientResponse *HttpClient::get(string path) {
-  write_request(path, "GET", "");
-  return read_response();
+  return send_request(path, "GET", "");
 }
 
 HTTPClientResponse *HttpClient::post(string path, string body) {
-  write_request(path, "POST", body);
-  return read_response();
+  return send_request(path, "POST", body);
 }
 
 HTTPClientResponse *HttpClient::put(string path, string body) {
-  write_request(path, "PUT", body);
-  return read_response();
+  return send_request(path, "PUT", body);
 }
 
 HTTPClientResponse *HttpClient::del(string path) {
-  write_request(path, "DELETE", "");
-  return read_response();
+  return send_request(path, "DELETE", "");
 }
@@ -1,6 +1,7 @@
 #include "MySocket.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 #include <string.h>
 #include <netdb.h>
@@ -80,6 +81,57 @@ void MySocket::write_bytes(const void *buffer, int len) {
     }
 }
 
+void MySocket::writev(const struct iovec *iov, int count, bool more) {
+    struct iovec left[count];
+    struct msghdr message;
+
+    if (sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    memcpy(left, iov, count * sizeof(struct iovec));
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = left;
+    message.msg_iovlen = count;
+    while (message.msg_iovlen > 0) {
+        ssize_t bytesWritten = ::sendmsg(sockFd, &message, more ? MSG_MORE : 0);
+        if (bytesWritten < 0) {
+	  throw SocketWriteError();
+        }
+        // skip what went out, which can end part way through a buffer
+        while (message.msg_iovlen > 0 &&
+               (size_t) bytesWritten >= message.msg_iov->iov_len) {
+            bytesWritten -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = (char *) message.msg_iov->iov_base + bytesWritten;
+            message.msg_iov->iov_len -= bytesWritten;
+        }
+    }
+}
+
+long MySocket::sendFile(int fd, off_t offset, long size) {
+    long sent = 0;
+
+    if (sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    while (sent < size) {
+        ssize_t bytesWritten = ::sendfile(sockFd, fd, &offset, size - sent);
+        if (bytesWritten < 0) {
+	  throw SocketWriteError();
+        }
+        if (bytesWritten == 0) {
+            break;
+        }
+        sent += bytesWritten;
+    }
+    return sent;
+}
+
 string MySocket::read() {
     char buffer[4096];
     if(sockFd<0) {
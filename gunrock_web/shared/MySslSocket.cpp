@@ -3,6 +3,8 @@
 #include <iostream>
 #include <sstream>
 
+#include <unistd.h>
+
 #include <openssl/conf.h>
 #include <openssl/opensslconf.h>
 
@@ -74,6 +76,32 @@ void MySslSocket::write(string buffer) {
   }
 }
 
+void MySslSocket::writev(const struct iovec *iov, int count, bool more) {
+  for (int i = 0; i < count; i++) {
+    if (iov[i].iov_len > 0) {
+      write(string((const char *) iov[i].iov_base, iov[i].iov_len));
+    }
+  }
+}
+
+long MySslSocket::sendFile(int fd, off_t offset, long size) {
+  char buffer[4096];
+  long sent = 0;
+  while (sent < size) {
+    long want = size - sent < (long) sizeof(buffer) ? size - sent : sizeof(buffer);
+    ssize_t bytesRead = pread(fd, buffer, want, offset + sent);
+    if (bytesRead < 0) {
+      throw SocketWriteError();
+    }
+    if (bytesRead == 0) {
+      break;
+    }
+    write(string(buffer, bytesRead));
+    sent += bytesRead;
+  }
+  return sent;
+}
+
 string MySslSocket::read() {
   char buffer[4096];
   if(sockFd<0 || ssl == NULL) {
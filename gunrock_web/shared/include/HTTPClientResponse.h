@@ -8,14 +8,23 @@
 
 class HTTPClientResponse {
  public:
-  HTTPClientResponse(MySocket *sock);    
+  // pending holds bytes already read from sock that belong to this
+  // response; whatever is read past its end is left there for the next
+  // one. NULL if the connection isn't reused.
+  HTTPClientResponse(MySocket *sock, std::string *pending = NULL);
   std::string readResponse();
   int status() { return m_status_code; }
   bool success() { return m_status_code >= 200 && m_status_code < 300; }
   std::string body() { return m_body; }
+  // false if the server closes the connection after this response
+  bool keepAlive() { return m_keep_alive; }
   
  protected:
+  bool readMore(std::string &data);
+
   MySocket *m_sock;
+  std::string *m_pending;
+  bool m_keep_alive;
   std::string m_body;
   std::map<std::string, std::string> m_headers;
   int m_status_code;
@@ -19,6 +19,10 @@ class HttpClient {
    *
    * Note: this call will block while establishing a connection.
    *
+   * The connection is kept alive and reused for later requests. If the
+   * server closed it in the meantime, the client connects again and
+   * resends the request, except for POSTs.
+   *
    * @param inetAddr either ip address, or the domain name
    * @param port the port to connect to
    */
@@ -98,7 +102,16 @@ class HttpClient {
   HTTPClientResponse *read_response();
   
  private:
+  void connect();
+  HTTPClientResponse *send_request(std::string path, std::string method, std::string body);
+
+  std::string inet_addr;
+  int port;
+  bool use_tls;
   MySocket *connection;
+  // responses read so far on connection, and bytes read past the last one
+  int num_responses;
+  std::string pending;
   std::map<std::string, std::string> headers;
 };
   
@@ -4,6 +4,9 @@
 #include <stdexcept>
 #include <string>
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 class SocketNotConnected : public std::runtime_error {
  public:
   SocketNotConnected() : std::runtime_error("socket not connected") {}
@@ -52,6 +55,22 @@ class MySocket {
   virtual std::string read();
   virtual void write(std::string data);
   virtual void close(void);
+
+  /*
+   * writes count buffers as one write without copying them together.
+   * With more set the data may wait for what is written next, like the
+   * headers in front of a body sent with sendFile.
+   */
+  virtual void writev(const struct iovec *iov, int count, bool more = false);
+
+  /*
+   * writes size bytes from offset in the file fd straight from the
+   * kernel with sendfile.  Returns fewer bytes than asked for only if
+   * the file ends first.
+   */
+  virtual long sendFile(int fd, off_t offset, long size);
+
+  int getFd() { return sockFd; }
   
  protected:
   void call_connect(const char *inetAddr, int port);
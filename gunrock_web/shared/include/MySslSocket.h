@@ -22,6 +22,10 @@ class MySslSocket: public MySocket {
   std::string read();
   void write(std::string data);
   void close(void);
+  // TLS has to encrypt everything in user space, so these just write
+  // each piece with write()
+  void writev(const struct iovec *iov, int count, bool more = false);
+  long sendFile(int fd, off_t offset, long size);
   
  protected:
   SSL_CTX *ctx;